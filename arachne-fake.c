@@ -0,0 +1,587 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  arachne-fake: a stand-in for the telescope's producer, that follows a
+  scripted scenario of faults, for testing how arachne copes with them.
+
+  It writes blocks of noise into a ring buffer with the same layout as
+  the telescope's, where arachne expects to find it (as set in arachne's
+  configuration). A scenario is a file with one step per line:
+
+    period <S>    Time between blocks, in s (1 by default).
+    jitter <S>    Blocks are early or late by up to this much, in s.
+    start <N>     Set the producer's block counter to N, in place.
+    run <N>       Write N blocks, one every period.
+    fast <N>      Write N blocks, as fast as possible.
+    pause <S>     Stall for S seconds.
+    jump <N>      Skip N blocks, as if they had been lost.
+    restart       Start counting blocks from zero again, in place.
+    recreate      Remove the ring buffer, and create a new one, as the
+                  producer does when it is restarted.
+    crash         Kill arachne outright, as if it had crashed.
+    launch        Start arachne again, after a crash.
+    expect <COUNTER> <OP> <VALUE>
+                  Once the scenario is over, check one of the counters
+                  in arachne's statsfile. OP is one of ==, !=, <, <=, >
+                  or >=.
+
+  Lines starting with '#' are comments. If given arachne's executable,
+  the fake starts arachne itself once the ring buffer exists, and stops
+  it once the scenario is over. Any checkpoint left by an earlier run is
+  removed first, so that every run starts afresh. Steps at the top of
+  the scenario that only set things up (period, jitter and start) are
+  carried out before arachne starts. A manifest of burst files, if
+  given, is passed on to arachne. Any failed expectation fails the run.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/* External libraries. */
+#include "extern/argtable3.h" // For argument parsing.
+#include "extern/log.h"       // For logging.
+#include "extern/toml.h"      // For parsing TOML files.
+
+#include "arachne.h" // For the shared helpers.
+#include "ring.h"    // For the layout of the ring buffers.
+#include "rng.h"     // For random number generation.
+
+#define MAXSTEPS 1024
+
+/* Steps in a scenario. */
+enum {
+  STEP_PERIOD,
+  STEP_JITTER,
+  STEP_START,
+  STEP_RUN,
+  STEP_FAST,
+  STEP_PAUSE,
+  STEP_JUMP,
+  STEP_RESTART,
+  STEP_RECREATE,
+  STEP_CRASH,
+  STEP_LAUNCH,
+  STEP_EXPECT,
+};
+
+/* Names of the steps, in the same order. */
+static const char *steps[] = {
+    "period", "jitter",  "start",    "run",   "fast",   "pause",
+    "jump",   "restart", "recreate", "crash", "launch", "expect",
+};
+
+/* Struct to store a single step of a scenario. */
+typedef struct {
+  int kind;     // Kind of step.
+  int line;     // Line of the scenario it is on.
+  double arg;   // Argument of the step, or the value to expect.
+  char key[64]; // Counter to check, for an expectation.
+  char op[4];   // Comparison to make, for an expectation.
+} Step;
+
+/* Struct to store the ring buffer the fake producer writes to. */
+typedef struct {
+  int backend;          // Backend of the segments.
+  int key;              // Key of the header's segment.
+  const char *prefix;   // Prefix for the names of POSIX segments.
+  Segment hdr;          // Segment of the ring buffer's header.
+  Segment buf;          // Segment of the ring buffer's data.
+  pthread_mutex_t lock; // Guards the segments while they are served.
+  int sock;             // Listening socket, for memfds.
+} Ring;
+
+/* Struct to store the state of the fake producer. */
+typedef struct {
+  Ring ring;            // The ring buffer.
+  unsigned int blk;     // Number of the next block.
+  int rec;              // Slot of the next block.
+  double period;        // Time between blocks, in s.
+  double jitter;        // Largest error in the time of a block, in s.
+  double blktime;       // Length of a block, in s.
+  unsigned char *noise; // Data written into every block.
+  unsigned int filled;  // Slots that already hold the noise, one bit each.
+  Rng rng;              // For the jitter.
+} Producer;
+
+/* Sleep for some time, in s. */
+void nap(double secs) {
+  if (secs <= 0.0) return;
+  struct timespec ts;
+  ts.tv_sec = (time_t)secs;
+  ts.tv_nsec = (long)((secs - ts.tv_sec) * 1e9);
+  while (nanosleep(&ts, &ts) < 0)
+    ;
+}
+
+/* Parse a scenario. Returns the number of steps. */
+int scenario_read(const char *path, Step *plan) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    log_error("Cannot open scenario %s.", path);
+    exit(1);
+  }
+
+  int nsteps = 0;
+  int lineno = 0;
+  char line[4096];
+  while (fgets(line, sizeof(line), fp)) {
+    lineno++;
+    char name[64];
+    if ((line[0] == '#') || (sscanf(line, "%63s", name) != 1)) continue;
+    if (nsteps == MAXSTEPS) {
+      log_error("Scenario %s has over %d steps.", path, MAXSTEPS);
+      exit(1);
+    }
+
+    Step *s = &plan[nsteps];
+    memset(s, 0, sizeof(Step));
+    s->kind = -1;
+    s->line = lineno;
+    for (int k = 0; k <= STEP_EXPECT; ++k)
+      if (strcmp(name, steps[k]) == 0) s->kind = k;
+
+    int nargs = 0;
+    switch (s->kind) {
+    case STEP_RESTART:
+    case STEP_RECREATE:
+    case STEP_CRASH:
+    case STEP_LAUNCH:
+      nargs = -1;
+      break;
+    case STEP_EXPECT:
+      nargs = sscanf(line, "%*s %63s %3s %lf", s->key, s->op, &s->arg) - 2;
+      if (strcmp(s->op, "==") && strcmp(s->op, "!=") && strcmp(s->op, "<") &&
+          strcmp(s->op, "<=") && strcmp(s->op, ">") && strcmp(s->op, ">="))
+        nargs = 0;
+      break;
+    case -1:
+      log_error("Unknown step '%s' on line %d of %s.", name, lineno, path);
+      exit(1);
+    default:
+      nargs = sscanf(line, "%*s %lf", &s->arg);
+    }
+    if ((nargs >= 0) && (nargs != 1)) {
+      log_error("Bad arguments for '%s' on line %d of %s.", name, lineno,
+                path);
+      exit(1);
+    }
+    nsteps++;
+  }
+  fclose(fp);
+  return nsteps;
+}
+
+/* Create the ring buffer, empty. Its data is filled in lazily by the
+ * kernel, so only the slots that have been written to take up memory.
+ */
+void ring_create(Ring *r) {
+  if ((seg_open(&r->hdr, r->backend, r->prefix, r->key, sizeof(Header),
+                SEG_CREATE, 0666) < 0) ||
+      (seg_open(&r->buf, r->backend, r->prefix, r->key + 1, sizeof(Buffer),
+                SEG_CREATE, 0666) < 0)) {
+    log_error("Could not create shared memory.");
+    exit(1);
+  }
+  Header *hdr = (Header *)r->hdr.addr;
+  Buffer *buf = (Buffer *)r->buf.addr;
+  memset(hdr, 0, sizeof(Header));
+  buf->flag = 0;
+  buf->curr_blk = 0;
+  buf->curr_rec = 0;
+  buf->blk_size = BLKSIZE;
+  buf->overflow = 0;
+  hdr->active = 1;
+}
+
+/* Detach from the ring buffer, and remove it. */
+void ring_destroy(Ring *r) {
+  seg_close(&r->hdr);
+  seg_close(&r->buf);
+  seg_remove(r->backend, r->prefix, r->key);
+  seg_remove(r->backend, r->prefix, r->key + 1);
+}
+
+/* Hand out the memfds of the ring buffer to arachne. */
+void *serve(void *arg) {
+  Ring *r = (Ring *)arg;
+  for (;;) {
+    int conn = accept(r->sock, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    pthread_mutex_lock(&r->lock);
+    if (ring_send(conn, &r->hdr, &r->buf) < 0)
+      log_warn("Could not send shared memory to arachne.");
+    pthread_mutex_unlock(&r->lock);
+    close(conn);
+  }
+  return NULL;
+}
+
+/* Write the next block into the ring buffer, and publish it. Every block
+ * holds the same noise, so it is only copied into a slot the first time
+ * the slot is written to, and blocks can be written as fast as arachne's
+ * ring buffer can be lapped.
+ */
+void publish(Producer *p) {
+  Header *hdr = (Header *)p->ring.hdr.addr;
+  Buffer *buf = (Buffer *)p->ring.buf.addr;
+  int slot = p->rec;
+
+  if (!(p->filled & (1u << slot)))
+    memcpy(buf->data + (long)BLKSIZE * (long)slot, p->noise, BLKSIZE);
+  p->filled |= 1u << slot;
+  buf->datatime[slot] = p->blktime * (double)p->blk;
+  buf->comptime[slot] = buf->datatime[slot];
+  gettimeofday(&hdr->timestamp[slot], NULL);
+  hdr->timestamp_gps[slot] = hdr->timestamp[slot];
+  hdr->datatime = buf->datatime[slot];
+
+  __atomic_store_n(&buf->curr_rec, (slot + 1) % MAXBLKS, __ATOMIC_RELEASE);
+  __atomic_store_n(&buf->curr_blk, p->blk + 1, __ATOMIC_RELEASE);
+  log_info("Published block no. %u in slot %d.", p->blk, slot);
+  p->blk++;
+  p->rec = (slot + 1) % MAXBLKS;
+}
+
+/* Set the producer's counters, in place. */
+void reset(Producer *p, unsigned int blk) {
+  Buffer *buf = (Buffer *)p->ring.buf.addr;
+  p->blk = blk;
+  p->rec = 0;
+  __atomic_store_n(&buf->curr_rec, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&buf->curr_blk, blk, __ATOMIC_RELEASE);
+}
+
+/* Carry out a step of the scenario. */
+void perform(Producer *p, Step *s) {
+  switch (s->kind) {
+  case STEP_PERIOD:
+    p->period = s->arg;
+    break;
+  case STEP_JITTER:
+    p->jitter = s->arg;
+    break;
+  case STEP_START:
+    log_info("Setting the block counter to %u.", (unsigned int)s->arg);
+    reset(p, (unsigned int)s->arg);
+    break;
+  case STEP_RUN:
+    log_info("Writing %d blocks, every %.3f s.", (int)s->arg, p->period);
+    for (int i = 0; i < (int)s->arg; ++i) {
+      nap(p->period + p->jitter * (2.0 * rng_uniform(&p->rng) - 1.0));
+      publish(p);
+    }
+    break;
+  case STEP_FAST:
+    log_info("Writing %d blocks, as fast as possible.", (int)s->arg);
+    for (int i = 0; i < (int)s->arg; ++i) publish(p);
+    break;
+  case STEP_PAUSE:
+    log_info("Stalling for %.3f s.", s->arg);
+    nap(s->arg);
+    break;
+  case STEP_JUMP:
+    log_info("Skipping %u blocks.", (unsigned int)s->arg);
+    p->blk += (unsigned int)s->arg;
+    break;
+  case STEP_RESTART:
+    log_info("Restarting in place.");
+    reset(p, 0);
+    break;
+  case STEP_RECREATE:
+    log_info("Recreating the ring buffer.");
+    pthread_mutex_lock(&p->ring.lock);
+    ring_destroy(&p->ring);
+    ring_create(&p->ring);
+    pthread_mutex_unlock(&p->ring.lock);
+    p->blk = 0;
+    p->rec = 0;
+    p->filled = 0;
+    break;
+  }
+}
+
+/* Start arachne, with a manifest of burst files, if any, and give it some
+ * time to attach. Returns its pid.
+ */
+pid_t launch(const char *program, const char *cfgpath, const char *manifest,
+             bool quiet, double startup) {
+  pid_t pid = fork();
+  if (pid < 0) {
+    log_error("Could not start arachne.");
+    exit(1);
+  }
+  if (pid == 0) {
+    if (quiet) freopen("/dev/null", "w", stdout);
+    if (manifest != NULL)
+      execl(program, program, "-c", cfgpath, "-m", manifest, (char *)NULL);
+    else
+      execl(program, program, "-c", cfgpath, (char *)NULL);
+    _exit(127);
+  }
+  log_info("Started arachne with pid = %d.", pid);
+  nap(startup);
+  return pid;
+}
+
+/* Check an expectation against arachne's counters. */
+bool check(Step *s, const char *statspath) {
+  FILE *fp = fopen(statspath, "r");
+  double actual = NAN;
+  if (fp) {
+    char key[64];
+    double val;
+    while (fscanf(fp, "%63s %lf", key, &val) == 2)
+      if (strcmp(key, s->key) == 0) actual = val;
+    fclose(fp);
+  }
+
+  bool ok = false;
+  if (isnan(actual))
+    ok = false;
+  else if (strcmp(s->op, "==") == 0)
+    ok = (actual == s->arg);
+  else if (strcmp(s->op, "!=") == 0)
+    ok = (actual != s->arg);
+  else if (strcmp(s->op, "<") == 0)
+    ok = (actual < s->arg);
+  else if (strcmp(s->op, "<=") == 0)
+    ok = (actual <= s->arg);
+  else if (strcmp(s->op, ">") == 0)
+    ok = (actual > s->arg);
+  else if (strcmp(s->op, ">=") == 0)
+    ok = (actual >= s->arg);
+
+  printf("%4d %-12s %2s %12g %12g %8s\n", s->line, s->key, s->op, s->arg,
+         actual, ok ? "ok" : "FAIL");
+  return ok;
+}
+
+/* The main function. */
+int main(int argc, char *argv[]) {
+  struct arg_lit *help;
+  struct arg_lit *version;
+  struct arg_lit *verbose;
+  struct arg_file *cfgfile;
+  struct arg_file *scenfile;
+  struct arg_file *program;
+  struct arg_file *manifest;
+  struct arg_dbl *startup;
+  struct arg_int *seed;
+  struct arg_end *end;
+
+  void *argtable[] = {
+      help = arg_litn("h", NULL, 0, 1, "Display help."),
+      version = arg_litn("V", NULL, 0, 1, "Display version."),
+      verbose = arg_litn("v", NULL, 0, 1, "Enable verbose output."),
+      cfgfile = arg_file1("c", NULL, "<FILE>", "Specify arachne's config."),
+      scenfile = arg_file1("s", NULL, "<FILE>", "Specify scenario file."),
+      program = arg_file0("a", NULL, "<FILE>", "Run arachne from here."),
+      manifest = arg_file0("m", NULL, "<FILE>", "Burst manifest for arachne."),
+      startup = arg_dbl0("w", NULL, "<S>", "Time for arachne to start (1)."),
+      seed = arg_int0("r", NULL, "<SEED>", "Seed for the jitter."),
+      end = arg_end(20),
+  };
+
+  int exitcode = 0;
+  char progname[] = "arachne-fake";
+  int nerrors = arg_parse(argc, argv, argtable);
+
+  if (help->count > 0) {
+    printf("Usage: %s", progname);
+    arg_print_syntax(stdout, argtable, "\n");
+    arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+    goto exit;
+  }
+
+  if (version->count > 0) {
+    printf("Version: %s\n", ARACHNE_VERSION);
+    goto exit;
+  }
+
+  if (nerrors > 0) {
+    arg_print_errors(stdout, end, progname);
+    printf("Try '%s --help' for more information.\n", progname);
+    exitcode = 1;
+    goto exit;
+  }
+
+  log_set_level(LOG_INFO);
+  if (verbose->count == 0) log_set_quiet(true);
+
+  static Step plan[MAXSTEPS];
+  int nsteps = scenario_read(*scenfile->filename, plan);
+
+  /* Find out where arachne looks for its input, and leaves its output. */
+  FILE *cf = fopen(*cfgfile->filename, "r");
+  char errbuf[200];
+  if (!cf) {
+    log_error("Cannot open configuration file.");
+    exit(1);
+  }
+  toml_table_t *fields = toml_parse_file(cf, errbuf, sizeof(errbuf));
+  if (!fields) {
+    log_error("Cannot parse configuration file: %s", errbuf);
+    exit(1);
+  }
+  fclose(cf);
+
+  toml_table_t *opts = section(fields, "opts");
+  toml_table_t *ringopts = section(fields, "ring");
+  toml_datum_t statsfile = toml_string_in(opts, "statsfile");
+  toml_datum_t ckptfile =
+      toml_string_in(section(fields, "inject"), "checkpoint");
+  toml_datum_t inname = toml_string_in(ringopts, "input");
+  toml_datum_t outname = toml_string_in(ringopts, "output");
+  toml_datum_t prefixname = toml_string_in(ringopts, "prefix");
+  toml_datum_t inkeyval = toml_int_in(ringopts, "inkey");
+  toml_datum_t outkeyval = toml_int_in(ringopts, "outkey");
+  toml_datum_t insockname = toml_string_in(ringopts, "insocket");
+  toml_datum_t outsockname = toml_string_in(ringopts, "outsocket");
+  Config cfg = configure(section(fields, "system"));
+
+  int inbackend = ring_backend((inname.ok) ? inname.u.s : "sysv");
+  int outbackend = ring_backend((outname.ok) ? outname.u.s : "sysv");
+  if ((inbackend < 0) || (outbackend < 0)) {
+    log_error("Ring buffers can only use sysv, posix or memfd.");
+    exit(1);
+  }
+  const char *prefix = (prefixname.ok) ? prefixname.u.s : "arachne";
+  int outkey = (outkeyval.ok) ? outkeyval.u.i : OUT_HDRKEY;
+  const char *insocket = (insockname.ok) ? insockname.u.s : "arachne-in.sock";
+  const char *outsocket = (outsockname.ok) ? outsockname.u.s : "arachne.sock";
+
+  bool expects = false;
+  for (int i = 0; i < nsteps; ++i) expects |= (plan[i].kind == STEP_EXPECT);
+  if (expects && !statsfile.ok) {
+    log_error("Expectations need a statsfile in arachne's configuration.");
+    exit(1);
+  }
+  if (statsfile.ok) remove(statsfile.u.s);
+  if (ckptfile.ok) remove(ckptfile.u.s);
+
+  /* Set up the producer, and its ring buffer. */
+  Producer p;
+  memset(&p, 0, sizeof(Producer));
+  p.ring.backend = inbackend;
+  p.ring.key = (inkeyval.ok) ? inkeyval.u.i : IN_HDRKEY;
+  p.ring.prefix = prefix;
+  p.ring.sock = -1;
+  p.period = 1.0;
+  p.blktime = (BLKSIZE / 4096) * cfg.dt;
+  rng_seed(&p.rng, (seed->count > 0) ? (uint64_t)*seed->ival : 1);
+  pthread_mutex_init(&p.ring.lock, NULL);
+
+  p.noise = (unsigned char *)malloc(BLKSIZE);
+  for (long i = 0; i < BLKSIZE; i += 8) {
+    uint64_t x = rng_next(&p.rng);
+    memcpy(p.noise + i, &x, 8);
+  }
+
+  ring_create(&p.ring);
+  if (inbackend == RING_MEMFD) {
+    p.ring.sock = ring_listen(insocket);
+    if (p.ring.sock < 0) {
+      log_error("Could not listen on %s.", insocket);
+      exit(1);
+    }
+    pthread_t tid;
+    pthread_create(&tid, NULL, serve, &p.ring);
+    pthread_detach(tid);
+  }
+
+  int next = 0;
+  while ((next < nsteps) && ((plan[next].kind == STEP_PERIOD) ||
+                             (plan[next].kind == STEP_JITTER) ||
+                             (plan[next].kind == STEP_START)))
+    perform(&p, &plan[next++]);
+
+  /* Start arachne. Crashing it, and starting it again, is done here,
+   * since only here is it known how to start it.
+   */
+  pid_t pid = -1;
+  bool quiet = (verbose->count == 0);
+  double wakeup = (startup->count > 0) ? *startup->dval : 1.0;
+  const char *bursts = (manifest->count > 0) ? *manifest->filename : NULL;
+  if (program->count > 0)
+    pid = launch(*program->filename, *cfgfile->filename, bursts, quiet,
+                 wakeup);
+
+  for (; next < nsteps; ++next) {
+    Step *s = &plan[next];
+    if ((s->kind == STEP_CRASH) && (pid > 0)) {
+      log_info("Killing arachne.");
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+      pid = -1;
+    } else if ((s->kind == STEP_LAUNCH) && (pid < 0) &&
+               (program->count > 0)) {
+      pid = launch(*program->filename, *cfgfile->filename, bursts, quiet,
+                   wakeup);
+    } else {
+      perform(&p, s);
+    }
+  }
+
+  /* Stop arachne. It should still be running, whatever happened. */
+  if (pid > 0) {
+    int status;
+    if (waitpid(pid, &status, WNOHANG) == pid) {
+      log_error("Arachne exited early, with status %d.", status);
+      exitcode = 1;
+    } else {
+      kill(pid, SIGINT);
+      waitpid(pid, &status, 0);
+    }
+    if (outbackend == RING_MEMFD) {
+      unlink(outsocket);
+    } else {
+      seg_remove(outbackend, prefix, outkey);
+      seg_remove(outbackend, prefix, outkey + 1);
+    }
+  }
+
+  if (expects) {
+    int nfailed = 0;
+    int nchecks = 0;
+    printf("%4s %-12s %2s %12s %12s %8s\n", "line", "counter", "op", "expected",
+           "actual", "result");
+    for (int i = 0; i < nsteps; ++i) {
+      if (plan[i].kind != STEP_EXPECT) continue;
+      nfailed += !check(&plan[i], statsfile.u.s);
+      nchecks++;
+    }
+    if (nfailed > 0) {
+      printf("%d of %d expectations failed.\n", nfailed, nchecks);
+      exitcode = 1;
+    } else {
+      printf("All %d expectations met.\n", nchecks);
+    }
+  }
+
+  ring_destroy(&p.ring);
+  if (p.ring.sock >= 0) {
+    close(p.ring.sock);
+    unlink(insocket);
+  }
+  free(p.noise);
+  toml_free(fields);
+
+exit:
+  arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+  return exitcode;
+}
@@ -0,0 +1,262 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  arachne-gen: generate a population of bursts, in parallel, and write
+  them out as aligned burst files, along with a manifest for arachne.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* External libraries. */
+#include "extern/argtable3.h" // For argument parsing.
+#include "extern/log.h"       // For logging.
+#include "extern/toml.h"      // For parsing TOML files.
+
+#include "arachne.h" // For the configuration.
+#include "burst.h"   // For synthesizing and writing bursts.
+#include "rng.h"     // For random number generation.
+
+/* Struct to store a range of values for a burst parameter. */
+typedef struct {
+  double lo;
+  double hi;
+} Range;
+
+/* Struct to store the work shared by the generator's threads. */
+typedef struct {
+  Config cfg;
+  Burst *bursts;
+  const char *outdir;
+  int count;
+  int next;
+  int done;
+  int failed;
+} Work;
+
+/* Get a number from a datum, whether it was written as a float or an
+ * integer. Returns false if it is neither.
+ */
+bool number(toml_datum_t dbl, toml_datum_t num, double *val) {
+  if (dbl.ok) *val = dbl.u.d;
+  else if (num.ok) *val = (double)num.u.i;
+  return dbl.ok || num.ok;
+}
+
+/* Get a range from the population table. A parameter may either be a
+ * single number, or an array of two numbers to draw uniformly between,
+ * the smaller first.
+ */
+Range range_in(toml_table_t *tab, const char *key, double fallback) {
+  Range r = {fallback, fallback};
+  toml_array_t *arr = toml_array_in(tab, key);
+  if (!toml_key_exists(tab, key)) {
+    if (isnan(fallback)) {
+      log_error("The population needs a value or range for %s.", key);
+      exit(1);
+    }
+    return r;
+  }
+  bool ok = false;
+  if (arr == NULL) {
+    ok = number(toml_double_in(tab, key), toml_int_in(tab, key), &r.lo);
+    r.hi = r.lo;
+  } else if (toml_array_nelem(arr) == 2) {
+    ok = number(toml_double_at(arr, 0), toml_int_at(arr, 0), &r.lo) &&
+         number(toml_double_at(arr, 1), toml_int_at(arr, 1), &r.hi);
+  }
+  if (!ok) {
+    log_error("The population's %s must be a number, or an array of two.",
+              key);
+    exit(1);
+  }
+  if (r.lo > r.hi) {
+    log_error("The population's range for %s goes from %g down to %g.", key,
+              r.lo, r.hi);
+    exit(1);
+  }
+  return r;
+}
+
+/* Draw a value from a range. */
+double draw(Range r, Rng *rng) {
+  return r.lo + (r.hi - r.lo) * rng_uniform(rng);
+}
+
+/* Order bursts by their arrival times. */
+int by_arrival(const void *a, const void *b) {
+  double ta = ((const Burst *)a)->tburst;
+  double tb = ((const Burst *)b)->tburst;
+  return (ta > tb) - (ta < tb);
+}
+
+/* Synthesize and write out bursts until there are none left. */
+void *worker(void *arg) {
+  Work *w = (Work *)arg;
+  char path[4096];
+  for (;;) {
+    int idx = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED);
+    if (idx >= w->count) break;
+    Burst *b = &w->bursts[idx];
+    synthesize(b, w->cfg);
+    snprintf(path, sizeof(path), "%s/burst%06d.bin", w->outdir, idx);
+    if (burst_write(path, b) < 0)
+      __atomic_fetch_add(&w->failed, 1, __ATOMIC_RELAXED);
+    burst_free(b);
+    __atomic_fetch_add(&w->done, 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/* The main function. */
+int main(int argc, char *argv[]) {
+  struct arg_lit *help;
+  struct arg_lit *version;
+  struct arg_lit *verbose;
+  struct arg_int *nthreads;
+  struct arg_str *outdir;
+  struct arg_file *cfgfile;
+  struct arg_end *end;
+
+  void *argtable[] = {
+      help = arg_litn("h", NULL, 0, 1, "Display help."),
+      version = arg_litn("V", NULL, 0, 1, "Display version."),
+      verbose = arg_litn("v", NULL, 0, 1, "Enable verbose output."),
+      nthreads = arg_int0("j", NULL, "<N>", "Number of threads."),
+      outdir = arg_str0("o", NULL, "<DIR>", "Output directory."),
+      cfgfile = arg_file1("c", NULL, "<FILE>", "Specify population file."),
+      end = arg_end(20),
+  };
+
+  int exitcode = 0;
+  char progname[] = "arachne-gen";
+  int nerrors = arg_parse(argc, argv, argtable);
+
+  if (help->count > 0) {
+    printf("Usage: %s", progname);
+    arg_print_syntax(stdout, argtable, "\n");
+    arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+    goto exit;
+  }
+
+  if (version->count > 0) {
+    printf("Version: %s\n", ARACHNE_VERSION);
+    goto exit;
+  }
+
+  if (nerrors > 0) {
+    arg_print_errors(stdout, end, progname);
+    printf("Try '%s --help' for more information.\n", progname);
+    exitcode = 1;
+    goto exit;
+  }
+
+  log_set_level(LOG_INFO);
+  if (verbose->count == 0) log_set_quiet(true);
+
+  FILE *cf = fopen(*cfgfile->filename, "r");
+  char errbuf[200];
+  if (!cf) {
+    fprintf(stderr, "Cannot open population file.\n");
+    exit(1);
+  }
+  toml_table_t *fields = toml_parse_file(cf, errbuf, sizeof(errbuf));
+  if (!fields) {
+    fprintf(stderr, "Cannot parse population file: %s\n", errbuf);
+    exit(1);
+  }
+  fclose(cf);
+
+  toml_table_t *pop = section(fields, "population");
+  toml_datum_t count = toml_int_in(pop, "count");
+  toml_datum_t seed = toml_int_in(pop, "seed");
+  Range dm = range_in(pop, "dm", NAN);
+  Range flux = range_in(pop, "flux", NAN);
+  Range width = range_in(pop, "width", NAN);
+  Range tburst = range_in(pop, "tburst", NAN);
+  Range tau = range_in(pop, "tau", 0.0);
+  if ((flux.lo <= 0.0) || (width.lo <= 0.0)) {
+    log_error("The population's fluxes and widths must be positive.");
+    exit(1);
+  }
+
+  Work w;
+  memset(&w, 0, sizeof(Work));
+  w.cfg = configure(section(fields, "system"));
+  w.count = (count.ok) ? count.u.i : 1;
+  w.outdir = (outdir->count > 0) ? *outdir->sval : "bursts";
+  if ((mkdir(w.outdir, 0755) < 0) && (errno != EEXIST)) {
+    fprintf(stderr, "Cannot create directory %s.\n", w.outdir);
+    exit(1);
+  }
+
+  /* Draw all parameters up front, so that they only depend on the seed. */
+  Rng rng;
+  rng_seed(&rng, (seed.ok) ? (uint64_t)seed.u.i : (uint64_t)time(NULL));
+  w.bursts = (Burst *)calloc(w.count, sizeof(Burst));
+  for (int idx = 0; idx < w.count; ++idx) {
+    w.bursts[idx].dm = draw(dm, &rng);
+    w.bursts[idx].flux = draw(flux, &rng);
+    w.bursts[idx].width = draw(width, &rng);
+    w.bursts[idx].tburst = draw(tburst, &rng);
+    w.bursts[idx].tau = draw(tau, &rng);
+  }
+  qsort(w.bursts, w.count, sizeof(Burst), by_arrival);
+
+  /* The manifest is written before synthesis frees up the bursts. */
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/manifest.txt", w.outdir);
+  FILE *mf = fopen(path, "w");
+  if (mf == NULL) {
+    fprintf(stderr, "Cannot write manifest %s.\n", path);
+    exit(1);
+  }
+  fprintf(mf, "# id file dm flux width tburst tau\n");
+  for (int idx = 0; idx < w.count; ++idx) {
+    Burst *b = &w.bursts[idx];
+    fprintf(mf, "%d burst%06d.bin %.6f %.6e %.6e %.9f %.6e\n", idx, idx, b->dm,
+            b->flux, b->width, b->tburst, b->tau);
+  }
+  fclose(mf);
+
+  int nthr = (nthreads->count > 0) ? *nthreads->ival : 0;
+  if (nthr <= 0) nthr = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthr <= 0) nthr = 1;
+
+  struct timeval t0, t1;
+  gettimeofday(&t0, NULL);
+  pthread_t *threads = (pthread_t *)malloc(nthr * sizeof(pthread_t));
+  for (int i = 0; i < nthr; ++i) pthread_create(&threads[i], NULL, worker, &w);
+  while (__atomic_load_n(&w.done, __ATOMIC_ACQUIRE) < w.count) {
+    log_info("Generated %d of %d bursts.", w.done, w.count);
+    usleep(500000);
+  }
+  for (int i = 0; i < nthr; ++i) pthread_join(threads[i], NULL);
+  gettimeofday(&t1, NULL);
+
+  double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) * 1e-6;
+  printf("Generated %d bursts in %.2f s with %d threads.\n", w.count, elapsed,
+         nthr);
+  if (w.failed > 0) {
+    fprintf(stderr, "Could not write %d bursts.\n", w.failed);
+    exitcode = 1;
+  }
+
+  free(threads);
+  free(w.bursts);
+  toml_free(fields);
+
+exit:
+  arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+  return exitcode;
+}
@@ -0,0 +1,566 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  arachne-inspect: look inside a dump, raw or packed, as fast as it can
+  be read off the disk.
+
+  The dump is mapped into memory, and its blocks are handed out to a few
+  threads. Each block is read a strip of rows at a time: a strip is
+  unpacked (if the dump is packed), checksummed against the block's CRC
+  in the dump's index, and then added to the statistics of each channel
+  while it is still in cache. Since samples only take the levels 0 to 3,
+  the number of samples at each level can be found exactly from the sums
+  of their first three powers, which are added up in 16-bit lanes, with
+  AVX2 where the CPU has it. This gives the bandpass (the mean of every
+  channel), its RMS, and how often each level occurs in it. The sum of
+  every row (the time series) is summarized for each block.
+
+  Given the truth catalog of the run, it also cuts out every injected
+  burst, using the dump's index to find the blocks it was injected into,
+  and dedisperses it at its DM. Everything is written to files next to
+  the dump, or with a prefix of your own.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* External libraries. */
+#include "extern/argtable3.h" // For argument parsing.
+#include "extern/log.h"       // For logging.
+
+#include "arachne.h" // For the shared helpers.
+#include "burst.h"   // For dispersion delays.
+#include "crc.h"     // For checking blocks against their CRCs.
+#include "dumpidx.h" // For finding blocks in the dump.
+#include "ring.h"    // For the size of a block.
+
+#define NLVLS 4
+#define FLUSH 2048 // Rows that 16-bit sums can take without overflowing.
+#define MAXTRUTH 4096
+
+/* Struct to store the summary of a block. */
+typedef struct {
+  double mean; // Mean of the time series.
+  double std;  // Standard deviation of the time series.
+  double min;  // Lowest point of the time series.
+  double max;  // Highest point of the time series.
+  int crc;     // 1 if it matches its CRC, 0 if not, and -1 if unknown.
+} Summary;
+
+/* Struct to store a scan of the dump, shared by all threads. */
+typedef struct {
+  const unsigned char *data; // The dump, mapped into memory.
+  long nblocks;              // Number of whole blocks in it.
+  long blksize;              // Size of a block in the dump, in bytes.
+  int nchan;                 // Number of channels.
+  int packing;               // Samples per byte.
+  int strip;                 // Rows read at a time.
+  const DumpIndex *idx;      // Its index, if it has one.
+  long next;                 // Next block to hand out.
+  int nthreads;              // Number of threads.
+  Summary *blocks;           // Summary of each block.
+} Scan;
+
+/* Struct to store the work of a single thread. */
+typedef struct {
+  Scan *scan;          // The scan.
+  uint64_t *sums[3];   // Sums of each power of the samples, per channel.
+  uint16_t *lanes[3];  // The same, over the last few rows.
+  unsigned char *rows; // A strip of unpacked rows.
+  long nrows;          // Number of rows read.
+} Worker;
+
+/* Struct to store a burst from the truth catalog. */
+typedef struct {
+  int id;        // Its id.
+  double dm;     // Its DM.
+  double tburst; // Its arrival time, at the highest frequency, in s.
+} Truth;
+
+/* Add a row of samples, and their squares and cubes, to the sums of each
+ * channel. Compiled for AVX2 as well, and picked at runtime.
+ */
+__attribute__((target_clones("avx2", "default"))) static void
+accumulate(uint16_t *s1, uint16_t *s2, uint16_t *s3, const unsigned char *row,
+           int n) {
+  for (int c = 0; c < n; ++c) {
+    uint16_t x = row[c];
+    s1[c] += x;
+    s2[c] += x * x;
+    s3[c] += x * x * x;
+  }
+}
+
+/* Sum a row of samples. */
+__attribute__((target_clones("avx2", "default"))) static uint32_t
+rowsum(const unsigned char *row, int n) {
+  uint32_t sum = 0;
+  for (int c = 0; c < n; ++c) sum += row[c];
+  return sum;
+}
+
+/* Move the 16-bit sums into the 64-bit ones. */
+void flush(Worker *w, int n) {
+  for (int k = 0; k < 3; ++k) {
+    for (int c = 0; c < n; ++c) w->sums[k][c] += w->lanes[k][c];
+    memset(w->lanes[k], 0, n * sizeof(uint16_t));
+  }
+}
+
+/* Read a block, a strip of rows at a time. */
+void block_read(Worker *w, long k) {
+  Scan *s = w->scan;
+  int n = s->nchan;
+  long nrows = s->blksize * s->packing / n;
+  long rowsize = (long)n / s->packing;
+  const unsigned char *blk = s->data + k * s->blksize;
+  uint32_t crc = 0;
+  double sum = 0.0;
+  double sumsq = 0.0;
+  double lo = INFINITY;
+  double hi = -INFINITY;
+  long pending = 0;
+
+  for (long r = 0; r < nrows; r += s->strip) {
+    long m = (r + s->strip > nrows) ? nrows - r : s->strip;
+    const unsigned char *rows = blk + r * rowsize;
+    if (s->packing > 1) {
+      dumpidx_unpack(w->rows, rows, m * n);
+      rows = w->rows;
+    }
+    if (s->idx) crc = crc32c(crc, rows, m * n);
+    for (long i = 0; i < m; ++i) {
+      accumulate(w->lanes[0], w->lanes[1], w->lanes[2], rows + i * n, n);
+      double x = rowsum(rows + i * n, n);
+      sum += x;
+      sumsq += x * x;
+      lo = min(lo, x);
+      hi = max(hi, x);
+      if (++pending == FLUSH) {
+        flush(w, n);
+        pending = 0;
+      }
+    }
+  }
+  flush(w, n);
+  w->nrows += nrows;
+
+  Summary *b = &s->blocks[k];
+  b->mean = sum / nrows;
+  b->std = sqrt(max(sumsq / nrows - b->mean * b->mean, 0.0));
+  b->min = lo;
+  b->max = hi;
+  b->crc = (s->idx) ? (crc == s->idx->ent[k].crc) : -1;
+}
+
+/* Take blocks, until there are none left. The kernel is asked to read
+ * ahead the block this thread will most likely take next.
+ */
+void *work(void *arg) {
+  Worker *w = (Worker *)arg;
+  Scan *s = w->scan;
+  for (;;) {
+    long k = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED);
+    if (k >= s->nblocks) break;
+    long ahead = k + s->nthreads;
+    if (ahead < s->nblocks)
+      madvise((void *)(s->data + ahead * s->blksize), s->blksize,
+              MADV_WILLNEED);
+    block_read(w, k);
+  }
+  return NULL;
+}
+
+/* Read the first line of every burst in a truth catalog. Returns the
+ * number of bursts.
+ */
+int truth_read(const char *path, Truth *truths) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) {
+    log_error("Cannot open truth catalog %s.", path);
+    exit(1);
+  }
+  int n = 0;
+  char line[4096];
+  while (fgets(line, sizeof(line), fp) && (n < MAXTRUTH)) {
+    Truth t;
+    if ((line[0] == '#') ||
+        (sscanf(line, "%*d %d %lf %*f %*f %lf", &t.id, &t.dm, &t.tburst) != 3))
+      continue;
+    bool seen = false;
+    for (int i = 0; i < n; ++i) seen |= (truths[i].id == t.id);
+    if (!seen) truths[n++] = t;
+  }
+  fclose(fp);
+  return n;
+}
+
+/* Cut a burst out of the dump, and dedisperse it. Rows from window s
+ * before its arrival to window s after it are written out, dedispersed,
+ * to <prefix>.burst<id>.cut, and their sums to <prefix>.burst<id>.series.
+ * Returns 0 on success, and -1 if it is not in the dump.
+ */
+int cutout(const DumpIndex *idx, const Truth *t, double window,
+           const char *prefix) {
+  long first;
+  long nhits = dumpidx_burst(idx, t->id, &first);
+  if (nhits == 0) return -1;
+
+  const DumpHead *h = idx->head;
+  int n = h->nchan;
+  long blknt = (long)h->blksize * h->packing / n;
+  double df = (h->fh - h->fl) / n;
+  int *delay = (int *)malloc(n * sizeof(int));
+  int maxdelay = 0;
+  for (int j = 0; j < n; ++j) {
+    int c = (h->flipped) ? n - 1 - j : j;
+    delay[j] = (int)floor(dmdelay(t->dm, h->fl + (c + 0.5) * df, h->fh) /
+                          h->tsamp);
+    maxdelay = (delay[j] > maxdelay) ? delay[j] : maxdelay;
+  }
+  long half = (long)(window / h->tsamp);
+  long beg = (long)(t->tburst / h->tsamp) - half;
+  long end = (long)(t->tburst / h->tsamp) + half;
+
+  /* Find the entries of the blocks the cutout needs. They are near the
+   * ones the burst was injected into, and those are contiguous in the
+   * dump, so they are all mapped at once.
+   */
+  long kbeg = (beg > 0) ? beg / blknt : 0;
+  long kend = (end + maxdelay) / blknt;
+  long *entries = (long *)malloc((kend - kbeg + 1) * sizeof(long));
+  long elo = -1;
+  long ehi = -1;
+  long near = (first > MAXBLKS) ? first - MAXBLKS : 0;
+  long far = (first + nhits + MAXBLKS < idx->count) ? first + nhits + MAXBLKS
+                                                     : idx->count;
+  for (long k = kbeg; k <= kend; ++k) {
+    entries[k - kbeg] = -1;
+    for (long e = near; e < far; ++e)
+      if (idx->ent[e].inblk == k) entries[k - kbeg] = e;
+    long e = entries[k - kbeg];
+    if (e < 0) continue;
+    if ((elo < 0) || (e < elo)) elo = e;
+    if (e > ehi) ehi = e;
+  }
+  DumpView view;
+  if ((elo < 0) || (dumpidx_map(idx, elo, ehi - elo + 1, &view) < 0)) {
+    free(delay);
+    free(entries);
+    return -1;
+  }
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s.burst%d.cut", prefix, t->id);
+  FILE *cut = fopen(path, "w");
+  snprintf(path, sizeof(path), "%s.burst%d.series", prefix, t->id);
+  FILE *series = fopen(path, "w");
+  if ((cut == NULL) || (series == NULL)) {
+    log_error("Cannot write the cutout of burst %d.", t->id);
+    exit(1);
+  }
+  fprintf(series, "# t series\n");
+
+  long rowsize = n / h->packing;
+  unsigned char *row = (unsigned char *)malloc(n);
+  double *sums = (double *)calloc(end - beg, sizeof(double));
+  for (long i = beg; i < end; ++i) {
+    double sum = 0.0;
+    for (int j = 0; j < n; ++j) {
+      long sample = i + delay[j];
+      long e = (sample < 0) ? -1 : entries[sample / blknt - kbeg];
+      row[j] = 0;
+      if (e < 0) continue;
+      const unsigned char *src = view.data + (e - elo) * (long)h->blksize +
+                                 (sample % blknt) * rowsize;
+      row[j] = (h->packing > 1) ? (src[j / 4] >> (2 * (j % 4))) & 0x03
+                                : src[j];
+      sum += row[j];
+    }
+    fwrite(row, 1, n, cut);
+    fprintf(series, "%.6f %.0f\n", i * h->tsamp, sum);
+    sums[i - beg] = sum;
+  }
+
+  /* Report the peak of the series, against the rest of it. */
+  double mean = 0.0;
+  double sq = 0.0;
+  long peak = 0;
+  for (long i = 0; i < end - beg; ++i) {
+    mean += sums[i];
+    sq += sums[i] * sums[i];
+    if (sums[i] > sums[peak]) peak = i;
+  }
+  mean /= (end - beg);
+  double std = sqrt(max(sq / (end - beg) - mean * mean, 0.0));
+  printf("%6d %10.3f %12.6f %6ld %12.6f %10.2f\n", t->id, t->dm, t->tburst,
+         nhits, (beg + peak) * h->tsamp,
+         (std > 0.0) ? (sums[peak] - mean) / std : 0.0);
+
+  fclose(cut);
+  fclose(series);
+  dumpidx_unmap(&view);
+  free(sums);
+  free(row);
+  free(entries);
+  free(delay);
+  return 0;
+}
+
+/* The main function. */
+int main(int argc, char *argv[]) {
+  struct arg_lit *help;
+  struct arg_lit *version;
+  struct arg_lit *verbose;
+  struct arg_file *dumpfile;
+  struct arg_int *nthreads;
+  struct arg_str *prefix;
+  struct arg_file *truthfile;
+  struct arg_int *ids;
+  struct arg_dbl *window;
+  struct arg_int *nchans;
+  struct arg_lit *packflag;
+  struct arg_end *end;
+
+  void *argtable[] = {
+      help = arg_litn("h", NULL, 0, 1, "Display help."),
+      version = arg_litn("V", NULL, 0, 1, "Display version."),
+      verbose = arg_litn("v", NULL, 0, 1, "Enable verbose output."),
+      nthreads = arg_int0("j", NULL, "<N>", "Number of threads."),
+      prefix = arg_str0("o", NULL, "<PREFIX>", "Prefix of the output files."),
+      truthfile = arg_file0("T", NULL, "<FILE>", "Cut out bursts from here."),
+      ids = arg_intn("b", NULL, "<ID>", 0, 100, "Only cut out these bursts."),
+      window = arg_dbl0("w", NULL, "<S>", "Half-width of cutouts (0.5 s)."),
+      nchans = arg_int0("n", NULL, "<N>", "Channels, without an index."),
+      packflag = arg_litn("p", NULL, 0, 1, "Packed, without an index."),
+      dumpfile = arg_file1(NULL, NULL, "<DUMP>", "Dump to inspect."),
+      end = arg_end(20),
+  };
+
+  int exitcode = 0;
+  char progname[] = "arachne-inspect";
+  int nerrors = arg_parse(argc, argv, argtable);
+
+  if (help->count > 0) {
+    printf("Usage: %s", progname);
+    arg_print_syntax(stdout, argtable, "\n");
+    arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+    goto exit;
+  }
+
+  if (version->count > 0) {
+    printf("Version: %s\n", ARACHNE_VERSION);
+    goto exit;
+  }
+
+  if (nerrors > 0) {
+    arg_print_errors(stdout, end, progname);
+    printf("Try '%s --help' for more information.\n", progname);
+    exitcode = 1;
+    goto exit;
+  }
+
+  log_set_level(LOG_INFO);
+  if (verbose->count == 0) log_set_quiet(true);
+
+  /* Open the dump, through its index if it has one. Without one, the
+   * dump is taken to have blocks of the usual size.
+   */
+  const char *path = *dumpfile->filename;
+  const char *out = (prefix->count > 0) ? *prefix->sval : path;
+  DumpIndex idx;
+  bool indexed = (dumpidx_open(&idx, path) == 0);
+  Scan scan;
+  memset(&scan, 0, sizeof(Scan));
+  int fd = -1;
+  long dumpsize = 0;
+  if (indexed) {
+    fd = idx.fd;
+    dumpsize = idx.dumpsize;
+    scan.idx = &idx;
+    scan.nchan = idx.head->nchan;
+    scan.packing = idx.head->packing;
+    scan.blksize = idx.head->blksize;
+  } else {
+    log_warn("%s has no index, so blocks cannot be checked.", path);
+    struct stat st;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if ((fd < 0) || (fstat(fd, &st) < 0)) {
+      log_error("Cannot open dump %s.", path);
+      exit(1);
+    }
+    dumpsize = st.st_size;
+    scan.nchan = (nchans->count > 0) ? *nchans->ival : 4096;
+    scan.packing = (packflag->count > 0) ? 4 : 1;
+    scan.blksize = BLKSIZE / scan.packing;
+  }
+  if ((scan.nchan <= 0) || (scan.nchan % 8 != 0)) {
+    log_error("The number of channels must be a multiple of 8.");
+    exit(1);
+  }
+  scan.nblocks = dumpsize / scan.blksize;
+  if (indexed) scan.nblocks = min(scan.nblocks, idx.count);
+  if (scan.nblocks == 0) {
+    log_error("%s does not have a whole block.", path);
+    exit(1);
+  }
+  scan.strip = max(3 * CRC32C_LANE / scan.nchan, 1);
+  scan.data = (const unsigned char *)mmap(
+      NULL, scan.nblocks * scan.blksize, PROT_READ, MAP_SHARED, fd, 0);
+  if (scan.data == MAP_FAILED) {
+    log_error("Cannot map dump %s.", path);
+    exit(1);
+  }
+  madvise((void *)scan.data, scan.nblocks * scan.blksize, MADV_SEQUENTIAL);
+  scan.blocks = (Summary *)calloc(scan.nblocks, sizeof(Summary));
+
+  /* Scan the dump, with every thread. */
+  int nthr = (nthreads->count > 0) ? *nthreads->ival
+                                   : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  nthr = clip(nthr, 1, scan.nblocks);
+  scan.nthreads = nthr;
+  Worker *workers = (Worker *)calloc(nthr, sizeof(Worker));
+  pthread_t *threads = (pthread_t *)malloc(nthr * sizeof(pthread_t));
+  struct timeval t0, t1;
+  gettimeofday(&t0, NULL);
+  for (int i = 0; i < nthr; ++i) {
+    Worker *w = &workers[i];
+    w->scan = &scan;
+    for (int k = 0; k < 3; ++k) {
+      w->sums[k] = (uint64_t *)calloc(scan.nchan, sizeof(uint64_t));
+      w->lanes[k] = (uint16_t *)calloc(scan.nchan, sizeof(uint16_t));
+    }
+    w->rows = (unsigned char *)malloc((long)scan.strip * scan.nchan);
+    pthread_create(&threads[i], NULL, work, w);
+  }
+  for (int i = 0; i < nthr; ++i) pthread_join(threads[i], NULL);
+  gettimeofday(&t1, NULL);
+  double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) * 1e-6;
+
+  /* Gather the sums of every thread. The number of samples at each
+   * level follows from the number of samples, and their first three
+   * moments: with levels 0 to 3, n3 = (s3 - 3 s2 + 2 s1) / 6, and so on.
+   */
+  long nrows = 0;
+  uint64_t total[NLVLS] = {0};
+  char name[4096];
+  snprintf(name, sizeof(name), "%s.bandpass", out);
+  FILE *bp = fopen(name, "w");
+  if (bp == NULL) {
+    log_error("Cannot write %s.", name);
+    exit(1);
+  }
+  for (int i = 0; i < nthr; ++i) nrows += workers[i].nrows;
+  fprintf(bp, "# chan freq p0 p1 p2 p3 mean rms\n");
+  for (int j = 0; j < scan.nchan; ++j) {
+    uint64_t s[3] = {0, 0, 0};
+    for (int i = 0; i < nthr; ++i)
+      for (int k = 0; k < 3; ++k) s[k] += workers[i].sums[k][j];
+    uint64_t n[NLVLS];
+    n[3] = (s[2] - 3 * s[1] + 2 * s[0]) / 6;
+    n[2] = (s[1] - s[0] - 6 * n[3]) / 2;
+    n[1] = s[0] - 2 * n[2] - 3 * n[3];
+    n[0] = nrows - n[1] - n[2] - n[3];
+    double mean = (double)s[0] / nrows;
+    double rms = sqrt(max((double)s[1] / nrows - mean * mean, 0.0));
+    double freq = NAN;
+    if (indexed) {
+      int c = (idx.head->flipped) ? scan.nchan - 1 - j : j;
+      freq = idx.head->fl + (c + 0.5) * (idx.head->fh - idx.head->fl) /
+                                scan.nchan;
+    }
+    fprintf(bp, "%d %.6f %.6f %.6f %.6f %.6f %.6f %.6f\n", j, freq,
+            (double)n[0] / nrows, (double)n[1] / nrows, (double)n[2] / nrows,
+            (double)n[3] / nrows, mean, rms);
+    for (int k = 0; k < NLVLS; ++k) total[k] += n[k];
+  }
+  fclose(bp);
+
+  /* Summarize the time series of every block. */
+  long ncorrupt = 0;
+  snprintf(name, sizeof(name), "%s.blocks", out);
+  FILE *bf = fopen(name, "w");
+  if (bf == NULL) {
+    log_error("Cannot write %s.", name);
+    exit(1);
+  }
+  fprintf(bf, "# blkno inblk gps flags nbursts mean std min max crc\n");
+  for (long k = 0; k < scan.nblocks; ++k) {
+    Summary *b = &scan.blocks[k];
+    const DumpEntry *e = (indexed) ? &idx.ent[k] : NULL;
+    fprintf(bf, "%ld %ld %.6f %u %u %.3f %.3f %.0f %.0f %s\n",
+            (e) ? (long)e->blkno : k, (e) ? (long)e->inblk : k,
+            (e) ? e->gps : NAN, (e) ? e->flags : 0, (e) ? e->nbursts : 0,
+            b->mean, b->std, b->min, b->max,
+            (b->crc < 0) ? "-" : (b->crc ? "ok" : "bad"));
+    if (b->crc == 0) {
+      log_error("Block no. %ld does not match its CRC.", (e) ? e->blkno : k);
+      ncorrupt++;
+    }
+  }
+  fclose(bf);
+
+  double bytes = (double)scan.nblocks * scan.blksize;
+  printf("Read %ld blocks (%.1f MB) in %.2f s, %.1f MB/s, with %d threads.\n",
+         scan.nblocks, bytes / 1e6, elapsed, bytes / 1e6 / elapsed, nthr);
+  double nsamples = (double)nrows * scan.nchan;
+  printf("Levels: %.4f %.4f %.4f %.4f.\n", total[0] / nsamples,
+         total[1] / nsamples, total[2] / nsamples, total[3] / nsamples);
+  if (indexed)
+    printf("Checked %ld blocks against their CRCs: %ld do not match.\n",
+           scan.nblocks, ncorrupt);
+  if (ncorrupt > 0) exitcode = 1;
+
+  /* Cut out the bursts in the truth catalog, or only the ones asked for. */
+  if (truthfile->count > 0) {
+    if (!indexed) {
+      log_error("Cutting out bursts needs the dump's index.");
+      exit(1);
+    }
+    static Truth truths[MAXTRUTH];
+    int ntruths = truth_read(*truthfile->filename, truths);
+    double half = (window->count > 0) ? *window->dval : 0.5;
+    printf("%6s %10s %12s %6s %12s %10s\n", "id", "dm", "tburst", "blocks",
+           "peak", "snr");
+    for (int i = 0; i < ntruths; ++i) {
+      bool wanted = (ids->count == 0);
+      for (int k = 0; k < ids->count; ++k)
+        wanted |= (ids->ival[k] == truths[i].id);
+      if (!wanted) continue;
+      if (cutout(&idx, &truths[i], half, out) < 0)
+        log_warn("Burst %d is not in the dump.", truths[i].id);
+    }
+  }
+
+  munmap((void *)scan.data, scan.nblocks * scan.blksize);
+  for (int i = 0; i < nthr; ++i) {
+    for (int k = 0; k < 3; ++k) {
+      free(workers[i].sums[k]);
+      free(workers[i].lanes[k]);
+    }
+    free(workers[i].rows);
+  }
+  free(workers);
+  free(threads);
+  free(scan.blocks);
+  if (indexed)
+    dumpidx_close(&idx);
+  else
+    close(fd);
+
+exit:
+  arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+  return exitcode;
+}
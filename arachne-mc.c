@@ -0,0 +1,256 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  arachne-mc: validate the statistics of injection, by Monte Carlo.
+
+  For each signal strength on a grid, input levels are drawn from the
+  distribution of 2-bit requantized noise, and passed through the same
+  transition() arachne uses to inject. The output levels for each input
+  level are compared with their analytic distribution, computed directly
+  from the noise intervals rather than the formulas in transition(), via
+  a chi-squared test. So is the mean shift in the level. Any significant
+  deviation, after correcting for the number of tests, fails the run.
+  The table-based fast path (table_transition()) can be tested instead.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* External libraries. */
+#include "extern/argtable3.h" // For argument parsing.
+
+#include "arachne.h" // For the shared helpers.
+#include "inject.h"  // For the injection under test.
+#include "rng.h"     // For random number generation.
+
+#define NLVLS 4
+
+/* Edges of the noise intervals for each level, in units of the RMS. */
+static const double edges[NLVLS + 1] = {-INFINITY, -1.0, 0.0, 1.0, INFINITY};
+
+/* Struct to store the work for a single thread. */
+typedef struct {
+  const Table *table;
+  double signal;
+  uint64_t seed;
+  long count;
+  long hist[NLVLS][NLVLS];
+} Task;
+
+/* Probability that the noise falls in [x1, x2). */
+double interval(double x1, double x2) {
+  if (x2 <= x1) return 0.0;
+  return prob(x2) - prob(x1);
+}
+
+/* Analytic probability of going from level j to level k with a signal. */
+double expected(int j, int k, double signal) {
+  double lo = max(edges[j], edges[k] - signal);
+  double hi = min(edges[j + 1], edges[k + 1] - signal);
+  return interval(lo, hi) / interval(edges[j], edges[j + 1]);
+}
+
+/* Survival function of the chi-squared distribution, for up to 3 dof. */
+double chi2sf(double x, int dof) {
+  if (dof <= 0) return 1.0;
+  if (dof == 1) return erfc(sqrt(x / 2.0));
+  if (dof == 2) return exp(-x / 2.0);
+  return erfc(sqrt(x / 2.0)) + sqrt(2.0 * x / M_PI) * exp(-x / 2.0);
+}
+
+/* Run simulated injections for a single thread. */
+void *simulate(void *arg) {
+  Task *task = (Task *)arg;
+  Rng rng;
+  rng_seed(&rng, task->seed);
+
+  /* Cumulative distribution of the input levels. */
+  double cdf[NLVLS];
+  double acc = 0.0;
+  for (int j = 0; j < NLVLS; ++j) {
+    acc += interval(edges[j], edges[j + 1]);
+    cdf[j] = acc;
+  }
+
+  for (long n = 0; n < task->count; ++n) {
+    double u = rng_uniform(&rng);
+    int in = 0;
+    while ((in < NLVLS - 1) && (u >= cdf[in])) ++in;
+    int out = (task->table)
+                  ? table_transition(task->table, in, task->signal,
+                                     (uint32_t)(rng_next(&rng) >> 32))
+                  : transition(in, task->signal, rng_uniform(&rng));
+    task->hist[in][out]++;
+  }
+  return NULL;
+}
+
+/* The main function. */
+int main(int argc, char *argv[]) {
+  struct arg_lit *help;
+  struct arg_lit *version;
+  struct arg_dbl *total;
+  struct arg_int *nthreads;
+  struct arg_dbl *smax;
+  struct arg_int *nsignal;
+  struct arg_dbl *alpha;
+  struct arg_int *seed;
+  struct arg_lit *tables;
+  struct arg_end *end;
+
+  void *argtable[] = {
+      help = arg_litn("h", NULL, 0, 1, "Display help."),
+      version = arg_litn("V", NULL, 0, 1, "Display version."),
+      total = arg_dbl0("n", NULL, "<N>", "Injections per signal (1e8)."),
+      nthreads = arg_int0("j", NULL, "<N>", "Number of threads."),
+      smax = arg_dbl0("s", NULL, "<S>", "Largest signal, in RMS (4)."),
+      nsignal = arg_int0("g", NULL, "<N>", "Number of signals (17)."),
+      alpha = arg_dbl0("a", NULL, "<P>", "Significance level (1e-6)."),
+      seed = arg_int0("r", NULL, "<SEED>", "Seed for the RNG."),
+      tables = arg_litn("t", NULL, 0, 1, "Test the table-based fast path."),
+      end = arg_end(20),
+  };
+
+  int exitcode = 0;
+  char progname[] = "arachne-mc";
+  int nerrors = arg_parse(argc, argv, argtable);
+
+  if (help->count > 0) {
+    printf("Usage: %s", progname);
+    arg_print_syntax(stdout, argtable, "\n");
+    arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+    goto exit;
+  }
+
+  if (version->count > 0) {
+    printf("Version: %s\n", ARACHNE_VERSION);
+    goto exit;
+  }
+
+  if (nerrors > 0) {
+    arg_print_errors(stdout, end, progname);
+    printf("Try '%s --help' for more information.\n", progname);
+    exitcode = 1;
+    goto exit;
+  }
+
+  long count = (long)((total->count > 0) ? *total->dval : 1e8);
+  double top = (smax->count > 0) ? *smax->dval : 4.0;
+  int ngrid = (nsignal->count > 0) ? *nsignal->ival : 17;
+  double level = (alpha->count > 0) ? *alpha->dval : 1e-6;
+  uint64_t base = (seed->count > 0) ? (uint64_t)*seed->ival : 1;
+  int nthr = (nthreads->count > 0) ? *nthreads->ival : 0;
+  if (nthr <= 0) nthr = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthr <= 0) nthr = 1;
+  if (ngrid < 1) ngrid = 1;
+
+  /* Each signal tests the distribution for every input level but the
+   * highest (which never changes), and the mean shift.
+   */
+  int ntests = ngrid * NLVLS;
+  double threshold = level / ntests;
+  int nfailed = 0;
+
+  Table *table = NULL;
+  if (tables->count > 0) {
+    table = (Table *)malloc(sizeof(Table));
+    table_build(table);
+  }
+
+  Task *tasks = (Task *)calloc(nthr, sizeof(Task));
+  pthread_t *threads = (pthread_t *)malloc(nthr * sizeof(pthread_t));
+
+  struct timeval t0, t1;
+  gettimeofday(&t0, NULL);
+  printf("%8s %4s %12s %12s %8s\n", "signal", "test", "statistic", "p-value",
+         "result");
+  for (int g = 0; g < ngrid; ++g) {
+    double signal = (ngrid > 1) ? top * g / (ngrid - 1) : top;
+
+    memset(tasks, 0, nthr * sizeof(Task));
+    for (int i = 0; i < nthr; ++i) {
+      tasks[i].table = table;
+      tasks[i].signal = signal;
+      tasks[i].seed = rng_mix(base + (uint64_t)g * nthr + i);
+      tasks[i].count = count / nthr + ((i < count % nthr) ? 1 : 0);
+      pthread_create(&threads[i], NULL, simulate, &tasks[i]);
+    }
+
+    long hist[NLVLS][NLVLS] = {{0}};
+    for (int i = 0; i < nthr; ++i) {
+      pthread_join(threads[i], NULL);
+      for (int j = 0; j < NLVLS; ++j)
+        for (int k = 0; k < NLVLS; ++k) hist[j][k] += tasks[i].hist[j][k];
+    }
+
+    /* Chi-squared test of the output levels, for each input level. */
+    double shift = 0.0;
+    double shift2 = 0.0;
+    double eshift = 0.0;
+    for (int j = 0; j < NLVLS - 1; ++j) {
+      long nj = 0;
+      for (int k = 0; k < NLVLS; ++k) nj += hist[j][k];
+
+      int dof = -1;
+      double stat = 0.0;
+      bool impossible = false;
+      for (int k = 0; k < NLVLS; ++k) {
+        double p = expected(j, k, signal);
+        double e = p * nj;
+        if (p > 0.0) {
+          stat += (hist[j][k] - e) * (hist[j][k] - e) / e;
+          dof++;
+        } else if (hist[j][k] > 0) {
+          impossible = true;
+        }
+        eshift += interval(edges[j], edges[j + 1]) * p * (k - j);
+        shift += (double)hist[j][k] * (k - j);
+        shift2 += (double)hist[j][k] * (k - j) * (k - j);
+      }
+      double pval = impossible ? 0.0 : chi2sf(stat, dof);
+      bool failed = (pval < threshold);
+      nfailed += failed;
+      printf("%8.3f %4s%d %12.3f %12.3e %8s\n", signal, "in=", j, stat, pval,
+             failed ? "FAIL" : "ok");
+    }
+
+    /* z-test of the mean shift in the level. */
+    shift /= count;
+    shift2 /= count;
+    double err = sqrt(max(shift2 - shift * shift, 1e-300) / count);
+    double z = (shift - eshift) / err;
+    double pval = erfc(fabs(z) / sqrt(2.0));
+    bool failed = (pval < threshold);
+    nfailed += failed;
+    printf("%8.3f %4s %12.3f %12.3e %8s\n", signal, "mean", z, pval,
+           failed ? "FAIL" : "ok");
+  }
+  gettimeofday(&t1, NULL);
+
+  double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) * 1e-6;
+  printf("Ran %.3e injections in %.2f s with %d threads (%.3e per s).\n",
+         (double)count * ngrid, elapsed, nthr, count * ngrid / elapsed);
+  if (nfailed > 0) {
+    printf("%d of %d tests failed.\n", nfailed, ntests);
+    exitcode = 1;
+  } else {
+    printf("All %d tests passed.\n", ntests);
+  }
+
+  free(table);
+  free(tasks);
+  free(threads);
+
+exit:
+  arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+  return exitcode;
+}
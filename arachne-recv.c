@@ -0,0 +1,332 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  arachne-recv: subscribe to arachne's exporter over TCP, and rebuild its
+  ring buffer on this machine, block for block and slot for slot, so that
+  consumers here can attach to it just as they would to arachne's.
+
+  Blocks that arrive torn, or that do not match their CRC, are left out,
+  as arachne would leave them out.
+  If the connection is lost, it connects again, for as long as it takes.
+  To test the exporter on a single machine, it can also check each block
+  it receives against the one in arachne's own ring buffer, found from
+  arachne's configuration. If arachne writes latency probes, as set in
+  its configuration, it finds them in the blocks it receives, and
+  reports the latency from each block arriving at the telescope's ring
+  buffer to it arriving here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+/* External libraries. */
+#include "extern/argtable3.h" // For argument parsing.
+#include "extern/log.h"       // For logging.
+#include "extern/toml.h"      // For parsing TOML files.
+
+#include "arachne.h" // For the shared helpers.
+#include "export.h"  // For receiving blocks over TCP.
+#include "probe.h"   // For finding latency probes.
+#include "ring.h"    // For the layout of the ring buffers.
+
+/* Struct to store arachne's ring buffer, to check blocks against. */
+typedef struct {
+  int backend;        // Backend of the segments.
+  int key;            // Key of the header's segment.
+  const char *prefix; // Prefix for the names of POSIX segments.
+  const char *socket; // Socket to get memfd segments from.
+  Segment hdr;        // Segment of the ring buffer's header.
+  Segment buf;        // Segment of the ring buffer's data.
+} Source;
+
+/* Sleep for some time, in s. */
+void nap(double secs) {
+  struct timespec ts = {(time_t)secs, (long)((secs - (time_t)secs) * 1e9)};
+  nanosleep(&ts, NULL);
+}
+
+/* Attach to arachne's ring buffer. Returns 0 on success, and -1 if it
+ * does not exist (yet).
+ */
+int source_attach(Source *src) {
+  if (src->hdr.addr != NULL) return 0;
+  if (src->backend == RING_MEMFD)
+    return ring_connect(src->socket, &src->hdr, &src->buf, SEG_RDONLY);
+  if (seg_open(&src->hdr, src->backend, src->prefix, src->key,
+               sizeof(RingHeader), SEG_RDONLY, 0) < 0)
+    return -1;
+  if (seg_open(&src->buf, src->backend, src->prefix, src->key + 1,
+               sizeof(Buffer), SEG_RDONLY, 0) < 0) {
+    seg_close(&src->hdr);
+    return -1;
+  }
+  return 0;
+}
+
+/* The main function. */
+int main(int argc, char *argv[]) {
+  struct arg_lit *help;
+  struct arg_lit *version;
+  struct arg_lit *verbose;
+  struct arg_str *host;
+  struct arg_int *port;
+  struct arg_str *backend;
+  struct arg_str *prefix;
+  struct arg_int *key;
+  struct arg_int *count;
+  struct arg_dbl *wait;
+  struct arg_file *cfgfile;
+  struct arg_lit *check;
+  struct arg_end *end;
+
+  void *argtable[] = {
+      help = arg_litn("h", NULL, 0, 1, "Display help."),
+      version = arg_litn("V", NULL, 0, 1, "Display version."),
+      verbose = arg_litn("v", NULL, 0, 1, "Enable verbose output."),
+      host = arg_str0("H", NULL, "<HOST>", "Host to connect to (localhost)."),
+      port = arg_int0("p", NULL, "<PORT>", "Port to connect to."),
+      backend = arg_str0("o", NULL, "<NAME>", "Local ring's backend (posix)."),
+      prefix = arg_str0("P", NULL, "<PREFIX>", "Local ring's prefix."),
+      key = arg_int0("k", NULL, "<KEY>", "Local ring's header key (5031)."),
+      count = arg_int0("n", NULL, "<N>", "Stop after N blocks."),
+      wait = arg_dbl0("w", NULL, "<S>", "Give up connecting after S s."),
+      cfgfile = arg_file0("c", NULL, "<FILE>", "Specify arachne's config."),
+      check = arg_litn("x", NULL, 0, 1, "Check blocks against arachne's."),
+      end = arg_end(20),
+  };
+
+  int exitcode = 0;
+  char progname[] = "arachne-recv";
+  int nerrors = arg_parse(argc, argv, argtable);
+
+  if (help->count > 0) {
+    printf("Usage: %s", progname);
+    arg_print_syntax(stdout, argtable, "\n");
+    arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+    goto exit;
+  }
+
+  if (version->count > 0) {
+    printf("Version: %s\n", ARACHNE_VERSION);
+    goto exit;
+  }
+
+  if (nerrors > 0) {
+    arg_print_errors(stdout, end, progname);
+    printf("Try '%s --help' for more information.\n", progname);
+    exitcode = 1;
+    goto exit;
+  }
+
+  log_set_level(LOG_INFO);
+  if (verbose->count == 0) log_set_quiet(true);
+
+  /* Find out where arachne exports, and where its ring buffer is. */
+  toml_table_t *fields = NULL;
+  Source src;
+  memset(&src, 0, sizeof(Source));
+  src.backend = RING_SYSV;
+  src.key = OUT_HDRKEY;
+  src.prefix = "arachne";
+  src.socket = "arachne.sock";
+  int exportport = EXPORT_PORT;
+  int nchan = 4096;
+  long probeperiod = 0;
+  int probelo = 0;
+  int probenf = 4;
+  if (cfgfile->count > 0) {
+    FILE *cf = fopen(*cfgfile->filename, "r");
+    char errbuf[200];
+    if (!cf) {
+      log_error("Cannot open configuration file.");
+      exit(1);
+    }
+    fields = toml_parse_file(cf, errbuf, sizeof(errbuf));
+    if (!fields) {
+      log_error("Cannot parse configuration file: %s", errbuf);
+      exit(1);
+    }
+    fclose(cf);
+
+    toml_table_t *ringopts = section(fields, "ring");
+    toml_datum_t outname = toml_string_in(ringopts, "output");
+    toml_datum_t prefixname = toml_string_in(ringopts, "prefix");
+    toml_datum_t outkeyval = toml_int_in(ringopts, "outkey");
+    toml_datum_t outsockname = toml_string_in(ringopts, "outsocket");
+    toml_datum_t portval = toml_int_in(section(fields, "export"), "port");
+    src.backend = ring_backend((outname.ok) ? outname.u.s : "sysv");
+    if (src.backend < 0) {
+      log_error("Ring buffers can only use sysv, posix or memfd.");
+      exit(1);
+    }
+    if (prefixname.ok) src.prefix = prefixname.u.s;
+    if (outkeyval.ok) src.key = outkeyval.u.i;
+    if (outsockname.ok) src.socket = outsockname.u.s;
+    if (portval.ok) exportport = portval.u.i;
+
+    toml_table_t *probeopts = section(fields, "probe");
+    toml_datum_t probeevery = toml_int_in(probeopts, "every");
+    toml_datum_t probechan = toml_int_in(probeopts, "channel");
+    toml_datum_t probewidth = toml_int_in(probeopts, "width");
+    nchan = configure(section(fields, "system")).nf;
+    if (probeevery.ok) probeperiod = probeevery.u.i;
+    if (probechan.ok) probelo = (int)probechan.u.i;
+    if (probewidth.ok) probenf = (int)probewidth.u.i;
+  } else if (check->count > 0) {
+    log_error("Checking blocks needs arachne's configuration.");
+    exit(1);
+  }
+
+  const char *where = (host->count > 0) ? *host->sval : "localhost";
+  int to = (port->count > 0) ? *port->ival : exportport;
+  int localbackend = ring_backend((backend->count > 0) ? *backend->sval
+                                                       : "posix");
+  const char *localprefix =
+      (prefix->count > 0) ? *prefix->sval : "arachne-recv";
+  int localkey = (key->count > 0) ? *key->ival : OUT_HDRKEY;
+  long limit = (count->count > 0) ? *count->ival : -1;
+  double patience = (wait->count > 0) ? *wait->dval : -1.0;
+  if ((localbackend != RING_SYSV) && (localbackend != RING_POSIX)) {
+    log_error("The local ring buffer can only use sysv or posix.");
+    exit(1);
+  }
+
+  /* Create the local ring buffer, exactly as arachne creates its own. */
+  Segment SegHdr, SegBuf;
+  if ((seg_open(&SegHdr, localbackend, localprefix, localkey,
+                sizeof(RingHeader), SEG_CREATE, 0666) < 0) ||
+      (seg_open(&SegBuf, localbackend, localprefix, localkey + 1,
+                sizeof(Buffer), SEG_CREATE, 0666) < 0)) {
+    log_error("Could not create shared memory.");
+    exit(1);
+  }
+  RingHeader *Hdr = (RingHeader *)SegHdr.addr;
+  Buffer *Buf = (Buffer *)SegBuf.addr;
+  Buf->curr_rec = 0;
+  Buf->curr_blk = 0;
+  memset(Hdr->seq, 0, sizeof(Hdr->seq));
+  memset(Hdr->blkno, 0xff, sizeof(Hdr->blkno));
+  Hdr->magic = RING_MAGIC;
+  Hdr->hdr.active = 1;
+
+  unsigned char *theirs = (unsigned char *)malloc(BLKSIZE);
+  long received = 0;
+  long torn = 0;
+  long corrupt = 0;
+  long mismatched = 0;
+  long unchecked = 0;
+  long reconnects = 0;
+  long probes = 0;
+  double lattotal = 0.0;
+  double latmax = 0.0;
+  struct timeval t0, t1;
+  gettimeofday(&t0, NULL);
+
+  int sock = -1;
+  double waited = 0.0;
+  while ((limit < 0) || (received + torn + corrupt < limit)) {
+    if (sock < 0) {
+      sock = export_connect(where, to);
+      if (sock < 0) {
+        if ((patience >= 0.0) && (waited >= patience)) {
+          log_error("Could not connect to %s:%d.", where, to);
+          exitcode = 1;
+          break;
+        }
+        nap(0.1);
+        waited += 0.1;
+        continue;
+      }
+      log_info("Connected to %s:%d.", where, to);
+      waited = 0.0;
+    }
+
+    unsigned int blk;
+    int res = export_recv(sock, Hdr, Buf, &blk);
+    if (res < 0) {
+      log_warn("Lost the connection to %s:%d.", where, to);
+      close(sock);
+      sock = -1;
+      reconnects++;
+      continue;
+    }
+    if (res == RING_OVERRUN) {
+      log_warn("Block no. %u arrived torn.", blk);
+      torn++;
+      continue;
+    }
+    if (res == RING_CORRUPT) {
+      log_error("Block no. %u does not match its CRC.", blk);
+      corrupt++;
+      continue;
+    }
+    received++;
+    log_info("Received block no. %u.", blk);
+
+    Probe pr;
+    unsigned char *got = Buf->data + (long)BLKSIZE * (long)(blk % MAXBLKS);
+    if ((probeperiod > 0) && probe_find(got, nchan, BLKSIZE / nchan, probelo,
+                                        probenf, 0, &pr)) {
+      double lat = probe_latency(&pr);
+      probes++;
+      lattotal += lat;
+      latmax = max(latmax, lat);
+      log_info("Probe no. %u in block no. %u: %.3f s since it arrived.",
+               pr.seq, blk, lat);
+    }
+
+    if (check->count > 0) {
+      unsigned char *ours = Buf->data + (long)BLKSIZE * (long)(blk % MAXBLKS);
+      int got = (source_attach(&src) < 0)
+                    ? RING_OVERRUN
+                    : ring_read((RingHeader *)src.hdr.addr,
+                                (Buffer *)src.buf.addr, blk, theirs, NULL);
+      if ((got == RING_OVERRUN) || (got == RING_PENDING)) {
+        unchecked++;
+      } else if ((got == RING_CORRUPT) ||
+                 (memcmp(ours, theirs, BLKSIZE) != 0)) {
+        log_error("Block no. %u differs from arachne's.", blk);
+        mismatched++;
+      }
+    }
+  }
+  gettimeofday(&t1, NULL);
+  if (sock >= 0) close(sock);
+
+  double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) * 1e-6;
+  printf("Received %ld blocks (%ld torn, %ld corrupt) in %.2f s, %.1f MB/s, "
+         "with %ld reconnects.\n",
+         received, torn, corrupt, elapsed,
+         received * (BLKSIZE / 1e6) / elapsed, reconnects);
+  if (check->count > 0) {
+    printf("Checked %ld blocks against arachne's: %ld differ, %ld were "
+           "already gone.\n",
+           received - unchecked, mismatched, unchecked);
+    if ((mismatched > 0) || (unchecked == received)) exitcode = 1;
+  }
+  if (probeperiod > 0) {
+    printf("Found %ld latency probes: %.3f s on average, %.3f s at most.\n",
+           probes, (probes > 0) ? lattotal / probes : 0.0, latmax);
+    if ((probes == 0) && (received >= probeperiod)) exitcode = 1;
+  }
+  if (corrupt > 0) exitcode = 1;
+
+  free(theirs);
+  seg_close(&SegHdr);
+  seg_close(&SegBuf);
+  seg_close(&src.hdr);
+  seg_close(&src.buf);
+  if (fields) toml_free(fields);
+
+exit:
+  arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+  return exitcode;
+}
@@ -0,0 +1,406 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  arachne-sink: a reference consumer of arachne's output ring buffer, to
+  tell problems in arachne apart from problems in whatever consumes it.
+
+  It attaches to the ring buffer just as a search pipeline would (found
+  from arachne's configuration), and reads every block arachne publishes,
+  consistently and with its CRC checked, spending a set time working on
+  each one, as a pipeline would. It reports:
+
+    - blocks that it read, and that did not match their CRC;
+    - gaps: blocks that arachne marked as coming after blocks it had to
+      skip or discard, or after the producer restarted;
+    - overruns: blocks that were overwritten before it could read them,
+      because it fell behind;
+    - out-of-order blocks: times the block counter went backwards, as it
+      does when arachne is restarted;
+    - the latency from each block being published to it being read, on
+      average, at the 99th percentile, and at most;
+    - the bandwidth it sustained, all told, and while copying blocks.
+
+  Several consumers can be run at once, each reading every block on its
+  own thread, to load the ring buffer as several pipelines would. It
+  stops after a number of blocks, on Ctrl+C, or once it has waited too
+  long to attach or for a block, and fails if any block was corrupt.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* External libraries. */
+#include "extern/argtable3.h" // For argument parsing.
+#include "extern/log.h"       // For logging.
+#include "extern/toml.h"      // For parsing TOML files.
+
+#include "arachne.h" // For the shared helpers.
+#include "ring.h"    // For the layout of the ring buffers.
+
+#define SINK_NBINS 10000 // Bins of latency, a ms each.
+
+/* Struct to store arachne's ring buffer. */
+typedef struct {
+  int backend;        // Backend of the segments.
+  int key;            // Key of the header's segment.
+  const char *prefix; // Prefix for the names of POSIX segments.
+  const char *socket; // Socket to get memfd segments from.
+  Segment hdr;        // Segment of the ring buffer's header.
+  Segment buf;        // Segment of the ring buffer's data.
+} Source;
+
+/* Struct to store a consumer, and what it has seen. */
+typedef struct {
+  int id;                // Number of the consumer.
+  Source *src;           // Ring buffer to read from.
+  long limit;            // Blocks to read, or -1 for no limit.
+  double work;           // Time to work on each block, in s.
+  double patience;       // Time to wait for a block, in s, or -1 for ever.
+  unsigned char *block;  // Block read.
+  long read;             // Blocks read.
+  long corrupt;          // Blocks that did not match their CRC.
+  long gaps;             // Blocks marked as coming after a gap.
+  long overruns;         // Blocks overwritten before they were read.
+  long reordered;        // Times the block counter went backwards.
+  double latsum;         // Sum of latencies, in s.
+  double latmax;         // Largest latency, in s.
+  long bins[SINK_NBINS]; // Latencies, a ms to a bin; the last holds more.
+  double copying;        // Time spent copying blocks, in s.
+  double first;          // When the first block was read, in s.
+  double last;           // When the last block was read, in s.
+} Consumer;
+
+/* Stop reading when asked to. */
+static volatile sig_atomic_t keep = 1;
+static void handler(int _) {
+  (void)_;
+  keep = 0;
+}
+
+/* Sleep for some time, in s. */
+void nap(double secs) {
+  struct timespec ts = {(time_t)secs, (long)((secs - (time_t)secs) * 1e9)};
+  nanosleep(&ts, NULL);
+}
+
+/* Get the time now, in s since the epoch. */
+double wall_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Attach to arachne's ring buffer. Returns 0 on success, and -1 if it
+ * does not exist (yet).
+ */
+int source_attach(Source *src) {
+  if (src->hdr.addr != NULL) return 0;
+  if (src->backend == RING_MEMFD)
+    return ring_connect(src->socket, &src->hdr, &src->buf, SEG_RDONLY);
+  if (seg_open(&src->hdr, src->backend, src->prefix, src->key,
+               sizeof(RingHeader), SEG_RDONLY, 0) < 0)
+    return -1;
+  if (seg_open(&src->buf, src->backend, src->prefix, src->key + 1,
+               sizeof(Buffer), SEG_RDONLY, 0) < 0) {
+    seg_close(&src->hdr);
+    return -1;
+  }
+  return 0;
+}
+
+/* Work on a block for some time, in s, as a pipeline would: go over it
+ * again and again, until the time is up. Returns a sum of what it read,
+ * so that none of it is optimized away.
+ */
+unsigned long work(const unsigned char *block, double secs) {
+  unsigned long sum = 0;
+  double until = wall_now() + secs;
+  for (long off = 0; wall_now() < until; off = (off + (1L << 16)) % BLKSIZE)
+    for (long i = off; i < off + (1L << 16); i += 64) sum += block[i];
+  return sum;
+}
+
+/* Get the latency below which some fraction of a consumer's are, in s,
+ * to the nearest ms.
+ */
+double percentile(const long *bins, long n, double frac) {
+  long want = (long)ceil(frac * n);
+  long seen = 0;
+  for (int k = 0; k < SINK_NBINS; ++k) {
+    seen += bins[k];
+    if ((seen >= want) && (seen > 0)) return (k + 1) * 1e-3;
+  }
+  return 0.0;
+}
+
+/* Read every block arachne publishes, from the next one on, until there
+ * are none for too long.
+ */
+void *consume(void *arg) {
+  Consumer *c = (Consumer *)arg;
+  RingHeader *hdr = (RingHeader *)c->src->hdr.addr;
+  Buffer *buf = (Buffer *)c->src->buf.addr;
+  volatile unsigned long sum = 0;
+  unsigned int next = __atomic_load_n(&buf->curr_blk, __ATOMIC_ACQUIRE);
+  double since = wall_now();
+
+  while (keep && ((c->limit < 0) || (c->read + c->overruns < c->limit))) {
+    unsigned int published =
+        __atomic_load_n(&buf->curr_blk, __ATOMIC_ACQUIRE);
+
+    /* Arachne started counting again, from an earlier block. */
+    if ((int)(published - next) < 0) {
+      log_warn("Consumer %d: block counter went back from %u to %u.", c->id,
+               next, published);
+      c->reordered++;
+      next = published;
+      continue;
+    }
+
+    double pubtime = 0.0;
+    double t0 = wall_now();
+    int res = ring_read(hdr, buf, next, c->block, &pubtime);
+    double t1 = wall_now();
+    if (res == RING_PENDING) {
+      if ((c->patience >= 0.0) && (t1 - since > c->patience)) {
+        log_warn("Consumer %d: no new block for %.1f s.", c->id,
+                 c->patience);
+        break;
+      }
+      nap(1e-3);
+      continue;
+    }
+    since = t1;
+    if (res == RING_OVERRUN) {
+      log_warn("Consumer %d: block no. %u was overwritten before it was "
+               "read.",
+               c->id, next);
+      c->overruns++;
+      next++;
+      continue;
+    }
+    if (res == RING_CORRUPT) {
+      log_error("Consumer %d: block no. %u does not match its CRC.", c->id,
+                next);
+      c->corrupt++;
+    }
+
+    /* The flags are read after the block, and so belong to a later block
+     * if the slot was rewritten in between, which is rare, since blocks
+     * are published a block's time apart.
+     */
+    int slot = next % MAXBLKS;
+    if (__atomic_load_n(&hdr->flags[slot], __ATOMIC_RELAXED) &
+        (RING_REALIGN | RING_DISCONT))
+      c->gaps++;
+
+    double lat = max(t1 - pubtime, 0.0);
+    int bin = (int)(lat * 1e3);
+    c->bins[(bin < SINK_NBINS) ? bin : SINK_NBINS - 1]++;
+    c->latsum += lat;
+    c->latmax = max(c->latmax, lat);
+    c->copying += t1 - t0;
+    if (c->read == 0) c->first = t0;
+    c->last = t1;
+    c->read++;
+    log_info("Consumer %d: read block no. %u, %.3f s after it was "
+             "published.",
+             c->id, next, lat);
+
+    if (c->work > 0.0) sum += work(c->block, c->work);
+    next++;
+  }
+  (void)sum;
+  return NULL;
+}
+
+/* Print what a consumer has seen. */
+void report(const char *name, Consumer *c) {
+  double elapsed = c->last - c->first;
+  double mb = c->read * (BLKSIZE / 1e6);
+  printf("%s: %ld blocks read (%ld corrupt), %ld gaps, %ld overruns, "
+         "%ld out of order.\n",
+         name, c->read, c->corrupt, c->gaps, c->overruns, c->reordered);
+  printf("%s: latency %.3f s on average, %.3f s at the 99th percentile, "
+         "%.3f s at most.\n",
+         name, (c->read > 0) ? c->latsum / c->read : 0.0,
+         percentile(c->bins, c->read, 0.99), c->latmax);
+  printf("%s: %.1f MB/s sustained, %.1f MB/s while copying.\n", name,
+         (elapsed > 0.0) ? mb / elapsed : 0.0,
+         (c->copying > 0.0) ? mb / c->copying : 0.0);
+}
+
+int main(int argc, char *argv[]) {
+  struct arg_lit *help;
+  struct arg_lit *version;
+  struct arg_lit *verbose;
+  struct arg_file *cfgfile;
+  struct arg_int *count;
+  struct arg_int *nconsumers;
+  struct arg_dbl *workval;
+  struct arg_dbl *wait;
+  struct arg_end *end;
+
+  void *argtable[] = {
+      help = arg_litn("h", NULL, 0, 1, "Display help."),
+      version = arg_litn("V", NULL, 0, 1, "Display version."),
+      verbose = arg_litn("v", NULL, 0, 1, "Enable verbose output."),
+      cfgfile = arg_file0("c", NULL, "<FILE>", "Specify arachne's config."),
+      count = arg_int0("n", NULL, "<N>", "Stop after N blocks."),
+      nconsumers = arg_int0("j", NULL, "<N>", "Number of consumers (1)."),
+      workval = arg_dbl0("W", NULL, "<S>", "Time to work on each block (0)."),
+      wait = arg_dbl0("w", NULL, "<S>", "Give up waiting after S s."),
+      end = arg_end(20),
+  };
+
+  int exitcode = 0;
+  char progname[] = "arachne-sink";
+  int nerrors = arg_parse(argc, argv, argtable);
+
+  if (help->count > 0) {
+    printf("Usage: %s", progname);
+    arg_print_syntax(stdout, argtable, "\n");
+    arg_print_glossary(stdout, argtable, "  %-25s %s\n");
+    goto exit;
+  }
+
+  if (version->count > 0) {
+    printf("Version: %s\n", ARACHNE_VERSION);
+    goto exit;
+  }
+
+  if (nerrors > 0) {
+    arg_print_errors(stdout, end, progname);
+    printf("Try '%s --help' for more information.\n", progname);
+    exitcode = 1;
+    goto exit;
+  }
+
+  log_set_level(LOG_INFO);
+  if (verbose->count == 0) log_set_quiet(true);
+
+  /* Find out where arachne's ring buffer is. */
+  toml_table_t *fields = NULL;
+  Source src;
+  memset(&src, 0, sizeof(Source));
+  src.backend = RING_SYSV;
+  src.key = OUT_HDRKEY;
+  src.prefix = "arachne";
+  src.socket = "arachne.sock";
+  if (cfgfile->count > 0) {
+    FILE *cf = fopen(*cfgfile->filename, "r");
+    char errbuf[200];
+    if (!cf) {
+      log_error("Cannot open configuration file.");
+      exit(1);
+    }
+    fields = toml_parse_file(cf, errbuf, sizeof(errbuf));
+    if (!fields) {
+      log_error("Cannot parse configuration file: %s", errbuf);
+      exit(1);
+    }
+    fclose(cf);
+
+    toml_table_t *ringopts = section(fields, "ring");
+    toml_datum_t outname = toml_string_in(ringopts, "output");
+    toml_datum_t prefixname = toml_string_in(ringopts, "prefix");
+    toml_datum_t outkeyval = toml_int_in(ringopts, "outkey");
+    toml_datum_t outsockname = toml_string_in(ringopts, "outsocket");
+    src.backend = ring_backend((outname.ok) ? outname.u.s : "sysv");
+    if (src.backend < 0) {
+      log_error("Ring buffers can only use sysv, posix or memfd.");
+      exit(1);
+    }
+    if (prefixname.ok) src.prefix = prefixname.u.s;
+    if (outkeyval.ok) src.key = outkeyval.u.i;
+    if (outsockname.ok) src.socket = outsockname.u.s;
+  }
+
+  long limit = (count->count > 0) ? *count->ival : -1;
+  int n = (nconsumers->count > 0) ? *nconsumers->ival : 1;
+  double secs = (workval->count > 0) ? *workval->dval : 0.0;
+  double patience = (wait->count > 0) ? *wait->dval : -1.0;
+  if (n < 1) {
+    log_error("There must be at least one consumer.");
+    exit(1);
+  }
+  signal(SIGINT, handler);
+  signal(SIGTERM, handler);
+
+  /* Wait for arachne to create its ring buffer. */
+  double waited = 0.0;
+  while (keep && (source_attach(&src) < 0)) {
+    if ((patience >= 0.0) && (waited >= patience)) {
+      log_error("Could not attach to arachne's ring buffer.");
+      exit(1);
+    }
+    nap(0.1);
+    waited += 0.1;
+  }
+  if (!keep) goto exit;
+  if (((RingHeader *)src.hdr.addr)->magic != RING_MAGIC) {
+    log_error("The ring buffer is not arachne's.");
+    exit(1);
+  }
+  log_info("Attached to arachne's ring buffer.");
+
+  Consumer *consumers = (Consumer *)calloc(n, sizeof(Consumer));
+  pthread_t *threads = (pthread_t *)malloc(n * sizeof(pthread_t));
+  for (int i = 0; i < n; ++i) {
+    consumers[i].id = i;
+    consumers[i].src = &src;
+    consumers[i].limit = limit;
+    consumers[i].work = secs;
+    consumers[i].patience = patience;
+    consumers[i].block = (unsigned char *)malloc(BLKSIZE);
+    pthread_create(&threads[i], NULL, consume, &consumers[i]);
+  }
+  for (int i = 0; i < n; ++i) pthread_join(threads[i], NULL);
+
+  /* Report on every consumer, and on all of them together, if several. */
+  Consumer *all = (Consumer *)calloc(1, sizeof(Consumer));
+  for (int i = 0; i < n; ++i) {
+    Consumer *c = &consumers[i];
+    char name[32];
+    snprintf(name, sizeof(name), "Consumer %d", i);
+    report(name, c);
+    all->read += c->read;
+    all->corrupt += c->corrupt;
+    all->gaps += c->gaps;
+    all->overruns += c->overruns;
+    all->reordered += c->reordered;
+    all->latsum += c->latsum;
+    all->latmax = max(all->latmax, c->latmax);
+    for (int k = 0; k < SINK_NBINS; ++k) all->bins[k] += c->bins[k];
+    all->copying += c->copying;
+    /* A consumer that read nothing has no times to fold in. */
+    if (c->read > 0) {
+      all->first = (all->first == 0.0) ? c->first : min(all->first, c->first);
+      all->last = max(all->last, c->last);
+    }
+    if (c->corrupt > 0) exitcode = 1;
+  }
+  if (n > 1) report("All", all);
+
+  for (int i = 0; i < n; ++i) free(consumers[i].block);
+  free(consumers);
+  free(threads);
+  free(all);
+  seg_close(&src.hdr);
+  seg_close(&src.buf);
+  if (fields) toml_free(fields);
+
+exit:
+  arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+  return exitcode;
+}
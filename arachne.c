@@ -7,81 +7,72 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/shm.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 /* External libraries. */
 #include "extern/argtable3.h" // For argument parsing.
 #include "extern/log.h"       // For logging.
-#include "extern/mt19937.h"   // For random number generation.
 #include "extern/toml.h"      // For parsing TOML files.
 
-/* Arachne's version number. */
-#define ARACHNE_VERSION "0.1.0"
-
-/* SHARED MEMORY SHENANIGANS!
- * ==========================
- *
- * For a sampling time of 1.31072 ms, the shared memory at the
- * telescope is structured as 32 blocks, with each block being
- * 512 samples, or 0.67108864 s, long. The entire shared memory
- * at the telescope is 21.47483648 s long, with a size of 64 MB.
- * We then form another shared memory when we wish to search for
- * FRBs, where each block is 21.47483648 s long, and there are
- * 16 blocks. This makes this shared memory 343.59738368 s long,
- * with a size of 1 GB.
- */
-#define MAXBLKS 16
-#define IN_HDRKEY 2031
-#define IN_BUFKEY 2032
-#define OUT_HDRKEY 5031
-#define OUT_BUFKEY 5032
-#define BLKSIZE (32 * 512 * 4096)
-#define TOTALSIZE (long)(BLKSIZE) * (long)(MAXBLKS)
-
-/* Struct for storing data from the ring buffer. */
-typedef struct {
-  unsigned int flag;
-  unsigned int curr_blk;
-  unsigned int curr_rec;
-  unsigned int blk_size;
-  int overflow;
-  double comptime[MAXBLKS];
-  double datatime[MAXBLKS];
-  unsigned char data[TOTALSIZE];
-} Buffer;
-
-/* Struct for storing the ring buffer's header. */
+#include "arachne.h"    // For the configuration.
+#include "arena.h"      // For memory that only lives as long as a block.
+#include "burst.h"      // For synthesizing and reading bursts.
+#include "checkpoint.h" // For picking up where a campaign left off.
+#include "dumpidx.h"    // For indexing the blocks in a dump.
+#include "export.h"     // For streaming the output ring buffer over TCP.
+#include "inject.h"     // For injecting signals into requantized data.
+#include "memory.h"     // For accounting for memory, against a budget.
+#include "probe.h"      // For probing the latency of the whole pipeline.
+#include "requant.h"    // For requantizing blocks, as fast as possible.
+#include "ring.h"       // For the layout of the ring buffers.
+#include "rng.h"        // For random number generation.
+#include "trace.h"      // For tracing allocations in the main loop.
+
+/* Struct to store Arachne's counters, which are exported to a file. */
 typedef struct {
-  unsigned int active;
-  unsigned int status;
-  double comptime;
-  double datatime;
-  double reftime;
-  struct timeval timestamp[MAXBLKS];
-  struct timeval timestamp_gps[MAXBLKS];
-  double blk_nano[MAXBLKS];
-} Header;
-
-/* Struct to store program configuration. */
+  unsigned long blocks;     // Blocks published.
+  unsigned long realigns;   // Times we fell behind and realigned.
+  unsigned long torn;       // Blocks overwritten by the producer as we read.
+  unsigned long reattaches; // Times the producer restarted.
+  unsigned long dropped;    // Input blocks skipped or discarded.
+  double latency;           // Latest publish latency, in s.
+  double maxlatency;        // Largest publish latency, in s.
+  double ready;             // Time from starting to being ready, in s.
+  double firstblock;        // Time taken to publish the first block, in s.
+  unsigned long fastblocks; // Blocks injected with tables, to save time.
+  unsigned long deferred;   // Bursts deferred to a later block.
+  unsigned long overruns;   // Blocks whose injection overran its budget.
+  unsigned long streamed;   // Blocks with no bursts, streamed straight out.
+  unsigned long injected;   // Blocks with bursts injected into them.
+  unsigned long probes;     // Blocks with a latency probe written into them.
+  unsigned long exported;   // Blocks sent to subscribers, intact.
+  unsigned long lagged;     // Blocks subscribers skipped, or got torn.
+  unsigned long subscribed; // Subscribers that have connected.
+  Memory *mem;              // Memory held, and loads shed, by subsystem.
+} Stats;
+
+/* Struct to store the input ring buffer, and how to attach to it. */
 typedef struct {
-  int nf;         // Number of channels.
-  double fl;      // Lowest frequency.
-  double fh;      // Highest frequency.
-  double dt;      // Sampling time.
-  double df;      // Channel width.
-  double bw;      // Bandwidth.
-  double tsys;    // System temperature.
-  double antgain; // Antenna gain.
-  double sysgain; // System gain.
-} Config;
+  int backend;        // Backend of the segments.
+  int key;            // Key of the header's segment.
+  const char *prefix; // Prefix for the names of POSIX segments.
+  const char *socket; // Socket to get memfd segments from.
+  Segment hdr;        // Segment of the ring buffer's header.
+  Segment buf;        // Segment of the ring buffer's data.
+} Input;
 
 /* Code to handle SIGINT. SIGINT is the signal sent when
  * we press Ctrl+C. One can think of SIGINT as a request
@@ -129,38 +120,935 @@ char *trim(char *str) {
   return str;
 }
 
-/* Find the lesser of two numbers. */
-double min(double x1, double x2) {
-  if (x1 < x2) return x1;
-  return x2;
+/* Get the time from a monotonic clock, in s. */
+double clock_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Find the first nonzero of a burst at or after a row (counted from its
+ * arrival), with a binary search of its rows, which are sorted.
+ */
+long burst_find(Burst *b, long row) {
+  long lo = 0;
+  long hi = b->nnz;
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (b->rows[mid] < row)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Inject the nonzeros of a burst that fall in the cells [beg, end) of
+ * the ring buffer's timeline into a block of requantized data, which
+ * starts at the cell blkbeg. If given a table, it is used instead of
+ * transition(). Returns the number of nonzeros injected.
+ */
+long inject(unsigned char *raw, Burst *b, Config cfg, long blkbeg, long beg,
+            long end, const Table *table, Rng *rng) {
+  long count = 0;
+  long offset = (long)(b->tburst / cfg.dt); /* Burst offset. */
+  double sigma = cfg.tsys / cfg.sysgain /
+                 sqrt(2 * cfg.dt * (cfg.df * 1e6)); /* Ideal RMS calculation. */
+
+  /* Entries are sorted by row, so only the rows in range are visited. */
+  long first = burst_find(b, beg / cfg.nf - offset);
+  long last = burst_find(b, (end - 1) / cfg.nf + 1 - offset);
+
+  /* Begin injection. */
+  for (long i = first; i < last; ++i) {
+    long I = (offset + (long)b->rows[i]) * (long)cfg.nf;
+
+    /* Flip the band if it is Band 4 at the GMRT, otherwise do nothing. */
+    if (cfg.band == 4)
+      I += (cfg.nf - 1 - (long)b->cols[i]);
+    else
+      I += (long)b->cols[i];
+
+    /* The first and last rows may only be partly in range. */
+    if ((I < beg) || (I >= end)) continue;
+    I -= blkbeg;
+    double signal = b->fluxes[i] / sigma;
+    if (table)
+      raw[I] = table_transition(table, raw[I], signal,
+                                (uint32_t)(rng_next(rng) >> 32));
+    else
+      raw[I] = transition(raw[I], signal, rng_uniform(rng));
+    count++;
+  }
+  return count;
+}
+
+/* Count the nonzeros of a burst that fall in a block, with a binary
+ * search of its rows, which are sorted. Also find out if any of them
+ * fall before the block, in which case the burst has already started.
+ */
+long burst_count(Burst *b, Config cfg, long blkbeg, long blkend,
+                 bool *started) {
+  long offset = (long)(b->tburst / cfg.dt);
+  long first = burst_find(b, blkbeg / cfg.nf - offset);
+  long last = burst_find(b, blkend / cfg.nf - offset);
+  *started = (first > 0);
+  return last - first;
+}
+
+/* Struct to store where a burst falls in the timeline, in the index of
+ * bursts, which is sorted by where they begin.
+ */
+typedef struct {
+  long beg; // First sample the burst may touch.
+  long end; // One past the last sample it may touch.
+  int id;   // Its id, in the truth catalog.
+} Span;
+
+/* Get where a burst falls in the timeline. Its rows are sorted, and the
+ * margin allows for shifting it by a fraction of a sample.
+ */
+Span span_of(Burst *b, int id, Config cfg, int margin) {
+  long offset = (long)(b->tburst / cfg.dt);
+  Span s = {offset + b->rows[0] - margin,
+            offset + b->rows[b->nnz - 1] + 1 + margin, id};
+  return s;
+}
+
+/* Order spans by where they begin. */
+int by_start(const void *a, const void *b) {
+  long sa = ((const Span *)a)->beg;
+  long sb = ((const Span *)b)->beg;
+  return (sa > sb) - (sa < sb);
+}
+
+/* Sort the index again, once some of its bursts have been moved. It is
+ * nearly sorted, so an insertion sort takes about one pass, and unlike
+ * qsort, it allocates nothing.
+ */
+void index_sort(Span *spans, int nspans) {
+  for (int i = 1; i < nspans; ++i) {
+    Span s = spans[i];
+    int j = i;
+    for (; (j > 0) && (spans[j - 1].beg > s.beg); --j) spans[j] = spans[j - 1];
+    spans[j] = s;
+  }
+}
+
+/* Check whether any burst in the index touches the samples [lo, hi). */
+bool index_busy(Span *spans, int nspans, long lo, long hi) {
+  for (int i = 0; (i < nspans) && (spans[i].beg < hi); ++i)
+    if (spans[i].end > lo) return true;
+  return false;
+}
+
+/* Get the memory held by a burst, in bytes. Memory from an arena is
+ * accounted for by the arena.
+ */
+long burst_bytes(Burst *b) {
+  if (b->map != NULL) return b->size;
+  if (b->arena != NULL) return 0;
+  if (b->rows == NULL) return 0;
+  return b->nnz * (long)(2 * sizeof(int) + sizeof(float));
+}
+
+/* Free a burst, and credit the memory it held back to its account. */
+void burst_release(Burst *b, Memory *mem) {
+  mem_credit(mem, MEM_BURSTS, burst_bytes(b));
+  burst_free(b);
+}
+
+/* Make room for some bytes more, if there is none, by evicting the
+ * synthesized bursts furthest ahead, that begin at or after a sample.
+ * Evicted bursts keep their parameters, and are synthesized again when
+ * they come up. Returns whether there is room.
+ */
+bool evict(Memory *mem, long bytes, Burst *synths, int nsynth, Span *spans,
+           int nspans, long from) {
+  for (int k = nspans - 1; (k >= 0) && (spans[k].beg >= from); --k) {
+    if (mem_room(mem, bytes)) break;
+    if ((spans[k].id >= nsynth) || (synths[spans[k].id].rows == NULL))
+      continue;
+    burst_release(&synths[spans[k].id], mem);
+    mem_shed(mem, MEM_BURSTS, 1);
+    log_debug("Evicted burst no. %d, to stay within the memory budget.",
+              spans[k].id);
+  }
+  return mem_room(mem, bytes);
+}
+
+/* Struct to store a burst that falls in the block being injected. */
+typedef struct {
+  Burst *b;      // The burst.
+  int id;        // Its id, in the truth catalog.
+  int priority;  // Its priority. Lower priorities are deferred first.
+  long count;    // Number of its nonzeros in the block.
+  bool started;  // Whether some of it fell in an earlier block.
+  bool deferred; // Whether it is deferred to a later block.
+  long from;     // First cell to inject it from, if it was partly injected
+                 // before a restart.
+} Job;
+
+/* Struct to store the budget for injecting into a block. */
+typedef struct {
+  double budget;  // Time available for injection in each block, in s.
+  double rate[2]; // Time taken per nonzero, with transition() and tables.
+} Budget;
+
+/* Plan the injection of a block, so that it fits in the time left. The
+ * cost of each burst is estimated from its nonzeros in the block, at the
+ * rates measured so far. If injecting every burst exactly would go over
+ * budget, the table is used instead. If even that goes over, the bursts
+ * with the lowest priorities (and then the most nonzeros) are deferred,
+ * except for those that have already started, since they cannot be cut
+ * in two. Returns true if the table should be used.
+ */
+bool schedule(Job *jobs, int njobs, Budget *bud, double left, Stats *st,
+              unsigned int blk) {
+  double cost = 0.0;
+  for (int j = 0; j < njobs; ++j)
+    if (!jobs[j].deferred) cost += jobs[j].count * bud->rate[0];
+  if ((njobs == 0) || (cost <= left)) return false;
+
+  double fast = cost * bud->rate[1] / bud->rate[0];
+  log_warn("Block no. %u needs %.2f s to inject, but has %.2f s. Using "
+           "tables (%.2f s).",
+           blk, cost, left, fast);
+  st->fastblocks++;
+
+  while (fast > left) {
+    Job *worst = NULL;
+    for (int j = 0; j < njobs; ++j) {
+      Job *job = &jobs[j];
+      if (job->started || job->deferred) continue;
+      if ((worst == NULL) || (job->priority < worst->priority) ||
+          ((job->priority == worst->priority) && (job->count > worst->count)))
+        worst = job;
+    }
+    if (worst == NULL) break;
+    worst->deferred = true;
+    fast -= worst->count * bud->rate[1];
+    st->deferred++;
+    log_warn("Deferring burst no. %d (priority %d) from block no. %u.",
+             worst->id, worst->priority, blk);
+  }
+  return true;
+}
+
+#define SLICES 4 // Slices per worker, when injecting into a block.
+
+/* Struct to store a slice of a block to inject into: a range of its
+ * cells, which no other slice shares.
+ */
+typedef struct {
+  long beg; // First cell.
+  long end; // One past the last cell.
+} Slice;
+
+/* Count the nonzeros of the bursts to inject that fall before a row. */
+long weight(Job *jobs, int njobs, Config cfg, long row) {
+  long w = 0;
+  for (int j = 0; j < njobs; ++j) {
+    if (jobs[j].deferred) continue;
+    long from = max(row, jobs[j].from / cfg.nf);
+    w += burst_find(jobs[j].b, from - (long)(jobs[j].b->tburst / cfg.dt));
+  }
+  return w;
+}
+
+/* Split the cells [blkbeg, blkend) into slices with about as many
+ * nonzeros to inject in each, rather than as many cells, since a bright
+ * burst can put most of a block's work into a few of its rows. Each cut
+ * is found by a binary search over rows. Within a row, nonzeros are
+ * taken to be spread evenly over channels, so that a row with more than
+ * a slice's share, as a burst with little dispersion has, is split too.
+ * Returns the number of slices, which is at most nslices.
+ */
+int slices_split(Job *jobs, int njobs, Config cfg, long blkbeg, long blkend,
+                 Slice *slices, int nslices) {
+  long r0 = blkbeg / cfg.nf;
+  long r1 = blkend / cfg.nf;
+  long w0 = weight(jobs, njobs, cfg, r0);
+  long total = weight(jobs, njobs, cfg, r1) - w0;
+  if (total == 0) nslices = 1;
+
+  int n = 0;
+  long prev = blkbeg;
+  for (int k = 1; k <= nslices; ++k) {
+    long cut = blkend;
+    if (k < nslices) {
+      long target = w0 + total * k / nslices;
+      long lo = r0;
+      long hi = r1;
+      while (lo < hi) {
+        long mid = lo + (hi - lo + 1) / 2;
+        if (weight(jobs, njobs, cfg, mid) <= target)
+          lo = mid;
+        else
+          hi = mid - 1;
+      }
+      long wlo = weight(jobs, njobs, cfg, lo);
+      long whi = (lo < r1) ? weight(jobs, njobs, cfg, lo + 1) : wlo;
+      double f = (whi > wlo) ? (double)(target - wlo) / (whi - wlo) : 0.0;
+      cut = clip(lo * cfg.nf + (long)(f * cfg.nf), prev, blkend);
+    }
+    if (cut <= prev) continue;
+    slices[n].beg = prev;
+    slices[n].end = cut;
+    prev = cut;
+    n++;
+  }
+  return n;
+}
+
+/* Struct to store the injection of a block, shared by the workers. */
+typedef struct {
+  unsigned char *raw; // The block.
+  Job *jobs;          // Bursts that fall in it.
+  int njobs;          // Number of them.
+  Config cfg;         // The configuration.
+  long blkbeg;        // First cell of the block.
+  const Table *table; // Table to inject with, if any.
+  Slice *slices;      // Slices of the block.
+  uint64_t seed;      // Seed for the slices' RNGs.
+  long *counts;       // Nonzeros injected into each slice.
+} Injection;
+
+/* Inject every burst into a slice of a block, in the same order as in
+ * the whole block, so that bursts that overlap build on each other as
+ * before. Each slice draws from an RNG of its own, seeded from the
+ * block's seed and its number, so that what is injected does not depend
+ * on which worker takes which slice.
+ */
+void inject_slice(void *ctx, long k) {
+  Injection *in = (Injection *)ctx;
+  Rng rng;
+  rng_seed(&rng, in->seed + (uint64_t)k);
+  long count = 0;
+  for (int j = 0; j < in->njobs; ++j) {
+    Job *job = &in->jobs[j];
+    if (job->deferred) continue;
+    count += inject(in->raw, job->b, in->cfg, in->blkbeg,
+                    max(in->slices[k].beg, job->from), in->slices[k].end,
+                    in->table, &rng);
+  }
+  in->counts[k] = count;
+}
+
+/* Struct to store the work done at startup, by the workers, while the
+ * main thread attaches to the ring buffers.
+ */
+typedef struct {
+  Pool *pool;         // Workers to do it with.
+  long ntasks;        // Number of tasks.
+  Burst *synths;      // Bursts to synthesize.
+  int nsynth;         // Number of them.
+  char **paths;       // Burst files to index.
+  int npaths;         // Number of them.
+  Config cfg;         // The configuration.
+  int margin;         // Margin of each span, in samples.
+  Span *spans;        // Span of each burst, by id, or an id of -1 if none.
+  int *status;        // Whether each burst file was read (0), was empty (1),
+                      // or could not be read (-1).
+  double *dms;        // DM of each burst, by id.
+  Table *table;       // Table of transitions, to build.
+  unsigned char *raw; // Block to inject into, to fault in.
+  Memory *mem;        // Accounts to charge synthesized bursts to.
+  Arena *arena;       // Arena for each block, to fault in.
+} Warmup;
+
+/* Do one task of the startup: synthesize a burst, or read a burst file
+ * to index it, or build the table of transitions, or fault in the block
+ * to inject into or the arena, so that the first block does not pay for
+ * any of it.
+ */
+void warm_task(void *ctx, long k) {
+  Warmup *w = (Warmup *)ctx;
+  int nbursts = w->nsynth + w->npaths;
+  Span none = {0, 0, -1};
+  if (k < w->nsynth) {
+    Burst *b = &w->synths[k];
+    synthesize(b, w->cfg);
+    w->dms[k] = b->dm;
+    w->spans[k] = (b->nnz > 0) ? span_of(b, k, w->cfg, w->margin) : none;
+
+    /* Bursts that do not fit in the budget are synthesized again, once
+     * they come up.
+     */
+    mem_charge(w->mem, MEM_BURSTS, burst_bytes(b));
+    if (!mem_room(w->mem, 0)) {
+      burst_release(b, w->mem);
+      mem_shed(w->mem, MEM_BURSTS, 1);
+    }
+  } else if (k < nbursts) {
+    Burst b;
+    int idx = k - w->nsynth;
+    w->spans[k] = none;
+    if (burst_read(w->paths[idx], &b, NULL) < 0) {
+      w->status[idx] = -1;
+      return;
+    }
+    w->dms[k] = b.dm;
+    w->status[idx] = (b.nnz == 0);
+    if (b.nnz > 0) w->spans[k] = span_of(&b, k, w->cfg, w->margin);
+    burst_free(&b);
+  } else if (k == nbursts) {
+    table_build(w->table);
+  } else if (k == nbursts + 1) {
+    memset(w->raw, 0, BLKSIZE);
+  } else {
+    arena_prefault(w->arena);
+  }
+}
+
+/* Run the startup's tasks, on a thread of their own. */
+void *warm_up(void *arg) {
+  Warmup *w = (Warmup *)arg;
+  pool_each(w->pool, warm_task, w, w->ntasks);
+  return NULL;
+}
+
+/* Struct to store the result of verifying an injected burst. */
+typedef struct {
+  double intended; // SNR of the burst, before requantization.
+  double achieved; // SNR measured from the requantized data.
+  double coverage; // Fraction of the burst's on-pulse region in the block.
+} Verdict;
+
+/* Verify that a burst was injected with the intended SNR.
+ *
+ * The burst's dedispersed fluence picks out its on-pulse region, which
+ * holds 90% of the fluence. Only the time-channel window around this
+ * region, padded on both sides by an off-pulse region, is dedispersed
+ * from the 2-bit levels in the block. The off-pulse region gives the
+ * mean and variance of the levels, against which the on-pulse region's
+ * SNR is measured. This keeps the cost to the burst's footprint, rather
+ * than the whole block. Scratch space comes from the block's arena, if
+ * any. Returns 1 if the burst was verified, and 0 if none of it falls in
+ * the block.
+ */
+int verify(unsigned char *raw, Burst *b, int *delay, Arena *arena, Config cfg,
+           long blkbeg, long blkend, Verdict *v) {
+  long offset = (long)(b->tburst / cfg.dt);
+  double sigma = cfg.tsys / cfg.sysgain / sqrt(2 * cfg.dt * (cfg.df * 1e6));
+
+  /* Find the extent of the burst once it is dedispersed. */
+  bool inside = false;
+  long dlo = 0;
+  long dhi = 0;
+  for (long i = 0; i < b->nnz; ++i) {
+    long dr = (long)b->rows[i] - delay[b->cols[i]];
+    if ((i == 0) || (dr < dlo)) dlo = dr;
+    if ((i == 0) || (dr > dhi)) dhi = dr;
+    long I = (offset + (long)b->rows[i]) * (long)cfg.nf + b->cols[i];
+    if ((I >= blkbeg) && (I < blkend)) inside = true;
+  }
+  if (!inside) return 0;
+
+  /* The on-pulse region holds the middle 90% of the fluence. */
+  long nd = dhi - dlo + 1;
+  double total = 0.0;
+  double *hist = (double *)arena_calloc(arena, nd, sizeof(double));
+  for (long i = 0; i < b->nnz; ++i) {
+    hist[(long)b->rows[i] - delay[b->cols[i]] - dlo] += b->fluxes[i];
+    total += b->fluxes[i];
+  }
+  long lo = 0;
+  long hi = nd - 1;
+  double cum = 0.0;
+  for (lo = 0; lo < nd - 1; ++lo) {
+    if (cum + hist[lo] > 0.05 * total) break;
+    cum += hist[lo];
+  }
+  cum = 0.0;
+  for (hi = nd - 1; hi > lo; --hi) {
+    if (cum + hist[hi] > 0.05 * total) break;
+    cum += hist[hi];
+  }
+  arena_release(arena, hist);
+  lo += dlo;
+  hi += dlo;
+  long non = hi - lo + 1;
+  long pad = (long)max(32, 4 * non);
+
+  /* The SNR the burst would have had without requantization. */
+  double signal = 0.0;
+  for (long i = 0; i < b->nnz; ++i) {
+    long dr = (long)b->rows[i] - delay[b->cols[i]];
+    long I = (offset + (long)b->rows[i]) * (long)cfg.nf + b->cols[i];
+    if ((dr >= lo) && (dr <= hi) && (I >= blkbeg) && (I < blkend))
+      signal += b->fluxes[i] / sigma;
+  }
+
+  /* Dedisperse the window around the burst, channel by channel. */
+  long sbeg = blkbeg / cfg.nf;
+  long send = blkend / cfg.nf;
+  long nt = non + 2 * pad;
+  double *sums = (double *)arena_calloc(arena, nt, sizeof(double));
+  long *counts = (long *)arena_calloc(arena, nt, sizeof(long));
+  for (long t = 0; t < nt; ++t) {
+    for (int c = 0; c < cfg.nf; ++c) {
+      long sample = offset + lo - pad + t + delay[c];
+      if ((sample < sbeg) || (sample >= send)) continue;
+      long ch = (cfg.band == 4) ? (cfg.nf - 1 - c) : c;
+      sums[t] += raw[(sample - sbeg) * cfg.nf + ch];
+      counts[t] += 1;
+    }
+  }
+
+  double offsum = 0.0;
+  long offcount = 0;
+  long oncount = 0;
+  for (long t = 0; t < nt; ++t) {
+    if ((t >= pad) && (t < pad + non)) {
+      oncount += counts[t];
+    } else {
+      offsum += sums[t];
+      offcount += counts[t];
+    }
+  }
+  double mean = (offcount > 0) ? offsum / offcount : 0.0;
+  double var = 0.0;
+  double excess = 0.0;
+  for (long t = 0; t < nt; ++t) {
+    double dev = sums[t] - mean * counts[t];
+    if ((t >= pad) && (t < pad + non))
+      excess += dev;
+    else
+      var += dev * dev;
+  }
+  var = (offcount > 0) ? var / offcount : 0.0;
+  arena_release(arena, sums);
+  arena_release(arena, counts);
+
+  v->intended = (oncount > 0) ? signal / sqrt((double)oncount) : 0.0;
+  v->achieved = (var > 0.0) ? excess / sqrt(var * oncount) : 0.0;
+  v->coverage = (double)oncount / ((double)non * cfg.nf);
+  return 1;
+}
+
+/* Verify a burst and record it in the truth catalog, if it was
+ * injected into this block.
+ */
+void record(FILE *truth, unsigned char *raw, Burst *b, int id, Delays *dcache,
+            Arena *arena, Config cfg, long blkbeg, long blkend, int blk) {
+  Verdict v;
+  int *delay = delays(dcache, b->dm, cfg);
+  if (!verify(raw, b, delay, arena, cfg, blkbeg, blkend, &v)) return;
+  log_debug("Burst no. %d: intended SNR = %.2f, achieved SNR = %.2f.", id,
+            v.intended, v.achieved);
+  fprintf(truth, "%d %d %.6f %.6e %.6e %.9f %.6e %.3f %.3f %.3f\n", blk, id,
+          b->dm, b->flux, b->width, b->tburst, b->tau, v.intended, v.achieved,
+          v.coverage);
+  fflush(truth);
+}
+
+/* Copy a block, as a kernel for the pool, so that blocks are copied out
+ * (and checksummed) the same way they are requantized.
+ */
+static void copy(unsigned char *dst, const unsigned char *src, long size) {
+  memcpy(dst, src, size);
+}
+
+/* Time each stage of processing a block, on synthetic data of the real
+ * size, and write the best time of each out to a file, as lines of
+ * "<stage> <seconds>". This is how builds are compared.
+ */
+void bench(const char *path, Config cfg, Kernels *kern) {
+  FILE *fp = fopen(path, "w");
+  FILE *sink = fopen("/dev/null", "w");
+  if ((fp == NULL) || (sink == NULL)) {
+    log_error("Cannot write benchmark to %s.", path);
+    exit(1);
+  }
+
+  enum { REPEATS = 5 };
+  unsigned char *src = (unsigned char *)malloc(BLKSIZE);
+  unsigned char *raw = (unsigned char *)malloc(BLKSIZE);
+  Rng rng;
+  rng_seed(&rng, 1);
+  for (long i = 0; i < BLKSIZE; i += 8) {
+    uint64_t x = rng_next(&rng);
+    memcpy(src + i, &x, 8);
+  }
+  memset(raw, 0, BLKSIZE);
+
+  for (int k = 0; k < NKERNELS; ++k) {
+    if (!kernel_ok(k)) continue;
+    double best = INFINITY;
+    for (int r = 0; r < REPEATS; ++r) {
+      double t0 = clock_now();
+      kernel_fns[k](raw, src, BLKSIZE);
+      best = min(best, clock_now() - t0);
+    }
+    fprintf(fp, "requant_%s %.6f\n", kernel_names[k], best);
+  }
+
+  /* Checksums, on their own, and fused with requantizing and copying. */
+  Pool pool;
+  pool_init(&pool, 1);
+  double crcs[5] = {INFINITY, INFINITY, INFINITY, INFINITY, INFINITY};
+  volatile uint32_t check = 0;
+  int fastest = kernel_ok(KERNEL_AVX2) ? KERNEL_AVX2 : KERNEL_SWAR;
+  for (int r = 0; r < REPEATS; ++r) {
+    uint32_t crc;
+    double t0 = clock_now();
+    check ^= crc32c_sw(0, src, BLKSIZE);
+    crcs[0] = min(crcs[0], clock_now() - t0);
+    t0 = clock_now();
+    check ^= crc32c(0, src, BLKSIZE);
+    crcs[1] = min(crcs[1], clock_now() - t0);
+    t0 = clock_now();
+    pool_run(&pool, kernel_fns[fastest], raw, src, BLKSIZE, BLKSIZE, &crc);
+    crcs[2] = min(crcs[2], clock_now() - t0);
+    t0 = clock_now();
+    pool_run(&pool, copy, raw, src, BLKSIZE, BLKSIZE, NULL);
+    crcs[3] = min(crcs[3], clock_now() - t0);
+    t0 = clock_now();
+    pool_run(&pool, copy, raw, src, BLKSIZE, BLKSIZE, &crc);
+    crcs[4] = min(crcs[4], clock_now() - t0);
+  }
+  pool_free(&pool);
+  fprintf(fp, "crc32c_sw %.6f\n", crcs[0]);
+  fprintf(fp, "crc32c %.6f\n", crcs[1]);
+  fprintf(fp, "requant_%s_crc %.6f\n", kernel_names[fastest], crcs[2]);
+  fprintf(fp, "copy %.6f\n", crcs[3]);
+  fprintf(fp, "copy_crc %.6f\n", crcs[4]);
+
+  double t0 = clock_now();
+  Table *table = (Table *)malloc(sizeof(Table));
+  table_build(table);
+  fprintf(fp, "tables %.6f\n", clock_now() - t0);
+
+  /* A bright, scattered burst, that lies wholly in the first block. */
+  Burst proto = {0};
+  proto.dm = 500.0;
+  proto.flux = 20.0;
+  proto.width = 1e-3;
+  proto.tburst = 2.0;
+  proto.tau = 1e-3;
+
+  double times[5] = {INFINITY, INFINITY, INFINITY, INFINITY, INFINITY};
+  Delays dcache = {0};
+  for (int r = 0; r < REPEATS; ++r) {
+    Burst b = proto;
+    t0 = clock_now();
+    synthesize(&b, cfg);
+    times[0] = min(times[0], clock_now() - t0);
+
+    b.exact = false;
+    t0 = clock_now();
+    shift(&b, kern, cfg);
+    times[1] = min(times[1], clock_now() - t0);
+
+    kernel_fns[KERNEL_SWAR](raw, src, BLKSIZE);
+    t0 = clock_now();
+    inject(raw, &b, cfg, 0, 0, BLKSIZE, NULL, &rng);
+    times[2] = min(times[2], clock_now() - t0);
+
+    kernel_fns[KERNEL_SWAR](raw, src, BLKSIZE);
+    t0 = clock_now();
+    inject(raw, &b, cfg, 0, 0, BLKSIZE, table, &rng);
+    times[3] = min(times[3], clock_now() - t0);
+
+    t0 = clock_now();
+    record(sink, raw, &b, 0, &dcache, NULL, cfg, 0, BLKSIZE, 0);
+    times[4] = min(times[4], clock_now() - t0);
+    burst_free(&b);
+  }
+  fprintf(fp, "synthesize %.6f\n", times[0]);
+  fprintf(fp, "shift %.6f\n", times[1]);
+  fprintf(fp, "inject_exact %.6f\n", times[2]);
+  fprintf(fp, "inject_table %.6f\n", times[3]);
+  fprintf(fp, "verify %.6f\n", times[4]);
+
+  /* The same burst, and the same with no dispersion, which puts all of
+   * its work into a few rows, injected by a pool with every CPU, a slice
+   * at a time. The two should take about as long.
+   */
+  Pool ipool;
+  int nthr = (int)max(1, sysconf(_SC_NPROCESSORS_ONLN));
+  pool_init(&ipool, nthr);
+  Slice *slices = (Slice *)calloc(SLICES * nthr, sizeof(Slice));
+  long *counts = (long *)calloc(SLICES * nthr, sizeof(long));
+  double spread[2] = {INFINITY, INFINITY};
+  for (int c = 0; c < 2; ++c) {
+    for (int r = 0; r < REPEATS; ++r) {
+      Burst b = proto;
+      if (c == 1) b.dm = 0.0;
+      synthesize(&b, cfg);
+      b.exact = false;
+      shift(&b, kern, cfg);
+      kernel_fns[KERNEL_SWAR](raw, src, BLKSIZE);
+      Job job = {&b, 0, 0, 0, false, false};
+      Injection in = {raw, &job, 1, cfg, 0, table, slices, 1, counts};
+      t0 = clock_now();
+      int n = slices_split(&job, 1, cfg, 0, BLKSIZE, slices, SLICES * nthr);
+      pool_each(&ipool, inject_slice, &in, n);
+      spread[c] = min(spread[c], clock_now() - t0);
+      burst_free(&b);
+    }
+  }
+  pool_free(&ipool);
+  free(slices);
+  free(counts);
+  fprintf(fp, "inject_dispersed %.6f\n", spread[0]);
+  fprintf(fp, "inject_bunched %.6f\n", spread[1]);
+
+  delays_free(&dcache);
+  free(table);
+  free(src);
+  free(raw);
+  fclose(sink);
+  fclose(fp);
+}
+
+/* Struct to store text being put together, to write out in one go. */
+typedef struct {
+  char buf[4096]; // The text.
+  size_t len;     // Its length.
+} Text;
+
+/* Append to a text, as printf would. Anything past its end is cut off. */
+void tprintf(Text *t, const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  size_t room = sizeof(t->buf) - t->len;
+  int n = vsnprintf(t->buf + t->len, room, fmt, args);
+  va_end(args);
+  if (n > 0) t->len += ((size_t)n < room) ? (size_t)n : room - 1;
+}
+
+/* Write the counters out to a file. The file is replaced atomically,
+ * so that anyone reading it always sees a consistent set of counters.
+ * It is put together in memory, and written without stdio, so that
+ * writing it allocates nothing.
+ */
+void stats_write(Stats *st, const char *path) {
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  Text sf;
+  sf.len = 0;
+  tprintf(&sf, "blocks %lu\n", st->blocks);
+  tprintf(&sf, "realigns %lu\n", st->realigns);
+  tprintf(&sf, "torn %lu\n", st->torn);
+  tprintf(&sf, "reattaches %lu\n", st->reattaches);
+  tprintf(&sf, "dropped %lu\n", st->dropped);
+  tprintf(&sf, "latency %.6f\n", st->latency);
+  tprintf(&sf, "maxlatency %.6f\n", st->maxlatency);
+  tprintf(&sf, "ready %.6f\n", st->ready);
+  tprintf(&sf, "firstblock %.6f\n", st->firstblock);
+  tprintf(&sf, "fastblocks %lu\n", st->fastblocks);
+  tprintf(&sf, "deferred %lu\n", st->deferred);
+  tprintf(&sf, "overruns %lu\n", st->overruns);
+  tprintf(&sf, "streamed %lu\n", st->streamed);
+  tprintf(&sf, "injected %lu\n", st->injected);
+  tprintf(&sf, "probes %lu\n", st->probes);
+
+  /* These are counted by the exporter's threads. */
+  tprintf(&sf, "exported %lu\n",
+          __atomic_load_n(&st->exported, __ATOMIC_RELAXED));
+  tprintf(&sf, "lagged %lu\n", __atomic_load_n(&st->lagged, __ATOMIC_RELAXED));
+  tprintf(&sf, "subscribed %lu\n",
+          __atomic_load_n(&st->subscribed, __ATOMIC_RELAXED));
+
+  /* So are these, by any thread that allocates. */
+  if (st->mem != NULL) {
+    Memory *m = st->mem;
+    for (int k = 0; k < MEM_KINDS; ++k)
+      tprintf(&sf, "mem%s %ld\n", mem_name(k),
+              __atomic_load_n(&m->used[k], __ATOMIC_RELAXED));
+    for (int k = 0; k < MEM_KINDS; ++k)
+      tprintf(&sf, "shed%s %lu\n", mem_name(k),
+              __atomic_load_n(&m->shed[k], __ATOMIC_RELAXED));
+    tprintf(&sf, "memtotal %ld\n",
+            __atomic_load_n(&m->total, __ATOMIC_RELAXED));
+    tprintf(&sf, "mempeak %ld\n", __atomic_load_n(&m->peak, __ATOMIC_RELAXED));
+    tprintf(&sf, "membudget %ld\n", m->budget);
+  }
+#ifdef ARACHNE_TRACE
+  tprintf(&sf, "allocs %lu\n", trace_allocs());
+#endif
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return;
+  ssize_t written = write(fd, sf.buf, sf.len);
+  close(fd);
+  if (written == (ssize_t)sf.len) rename(tmp, path);
+}
+
+/* Attach to the input ring buffer. Returns 0 on success, and -1 if it
+ * does not exist (yet).
+ */
+int input_attach(Input *in) {
+  if (in->backend == RING_MEMFD)
+    return ring_connect(in->socket, &in->hdr, &in->buf, SEG_RDONLY);
+  if (seg_open(&in->hdr, in->backend, in->prefix, in->key, sizeof(Header),
+               SEG_RDONLY, 0) < 0)
+    return -1;
+  if (seg_open(&in->buf, in->backend, in->prefix, in->key + 1,
+               sizeof(Buffer), SEG_RDONLY, 0) < 0) {
+    seg_close(&in->hdr);
+    return -1;
+  }
+  return 0;
 }
 
-/* Find the greater of two numbers. */
-double max(double x1, double x2) {
-  if (x1 > x2) return x1;
-  return x2;
+/* Check whether the producer has replaced the input ring buffer with a
+ * new one, as it does when it restarts, and if so, attach to the new one.
+ * SysV and POSIX segments are looked up by key, to see if they are still
+ * the ones we are attached to. Memfds have no name, so they are only
+ * fetched again once no block has arrived for some time (idle > stale).
+ * Returns true if we have attached to a new ring buffer.
+ */
+bool input_replaced(Input *in, double idle, double stale) {
+  Segment hdr, buf;
+  if (in->backend == RING_MEMFD) {
+    if (idle < stale) return false;
+    if (ring_connect(in->socket, &hdr, &buf, SEG_RDONLY) < 0) return false;
+    if (seg_same(&buf, &in->buf)) {
+      seg_close(&hdr);
+      seg_close(&buf);
+      return false;
+    }
+  } else {
+    if (seg_find(&buf, in->backend, in->prefix, in->key + 1) < 0) return false;
+    bool same = seg_same(&buf, &in->buf);
+    if (in->backend == RING_POSIX) close(buf.id);
+    if (same) return false;
+
+    /* Make sure the new ring buffer is complete before switching. */
+    Input next = *in;
+    if (input_attach(&next) < 0) return false;
+    hdr = next.hdr;
+    buf = next.buf;
+  }
+
+  log_warn("Input ring buffer replaced, reattaching (id %d -> %d).",
+           in->buf.id, buf.id);
+  seg_close(&in->hdr);
+  seg_close(&in->buf);
+  in->hdr = hdr;
+  in->buf = buf;
+  return true;
 }
 
-/* Clip a number b/w two values. */
-double clip(double x, double x1, double x2) {
-  if (x >= x1 && x < x2) return x;
-  if (x < x1) return x1;
-  return x2;
+/* Struct to store the state of the server for memfd segments. */
+typedef struct {
+  int sock;     // Listening socket.
+  Segment *hdr; // Segment of the ring buffer's header.
+  Segment *buf; // Segment of the ring buffer's data.
+} Server;
+
+/* Hand out the memfds of the output ring buffer to consumers. */
+void *serve(void *arg) {
+  Server *srv = (Server *)arg;
+  for (;;) {
+    int conn = accept(srv->sock, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (ring_send(conn, srv->hdr, srv->buf) < 0)
+      log_warn("Could not send shared memory to a consumer.");
+    close(conn);
+  }
+  return NULL;
 }
 
-/* Find the probability of a Gaussian random variable. */
-double prob(double x) { return 0.5 + 0.5 * erf(x / sqrt(2)); }
+/* Struct to store the state of the exporter, which streams the output
+ * ring buffer to subscribers over TCP.
+ */
+typedef struct {
+  int sock;             // Listening socket.
+  int backlog;          // Blocks a subscriber may fall behind by.
+  bool zerocopy;        // Whether to send with MSG_ZEROCOPY.
+  RingHeader *hdr;      // Header of the output ring buffer.
+  Buffer *buf;          // Data of the output ring buffer.
+  Stats *stats;         // Counters, shared with the main loop.
+  pthread_mutex_t lock; // Lock for waiting on new blocks.
+  pthread_cond_t cond;  // Signalled whenever a block is published.
+} Exporter;
+
+/* Struct to store a subscriber to the exporter. */
+typedef struct {
+  Exporter *ex; // The exporter.
+  int conn;     // Connection to the subscriber.
+} Subscriber;
+
+/* Stream blocks to a subscriber, as they are published, starting with
+ * as many of the latest as its backlog allows. A subscriber that falls
+ * further behind than that skips ahead to the latest block, which is
+ * flagged as realigned, so it never holds up arachne or anyone else.
+ */
+void *subscribe(void *arg) {
+  Subscriber *sub = (Subscriber *)arg;
+  Exporter *ex = sub->ex;
+  bool zerocopy = ex->zerocopy && export_zerocopy(sub->conn);
+  uint32_t issued = 0;
+  uint32_t done = 0;
+  unsigned int flags = 0;
+  unsigned int next = __atomic_load_n(&ex->buf->curr_blk, __ATOMIC_ACQUIRE);
+  next -= (unsigned int)min(next, ex->backlog);
+  for (;;) {
+    pthread_mutex_lock(&ex->lock);
+    while (__atomic_load_n(&ex->buf->curr_blk, __ATOMIC_ACQUIRE) == next)
+      pthread_cond_wait(&ex->cond, &ex->lock);
+    unsigned int published = ex->buf->curr_blk;
+    pthread_mutex_unlock(&ex->lock);
+
+    if (published - next > (unsigned int)ex->backlog) {
+      __atomic_fetch_add(&ex->stats->lagged, published - 1 - next,
+                         __ATOMIC_RELAXED);
+      next = published - 1;
+      flags |= RING_REALIGN;
+    }
+    int res = export_send(sub->conn, ex->hdr, ex->buf, next, flags, zerocopy,
+                          &issued, &done);
+    if (res < 0) break;
+    if (res == RING_OK) {
+      __atomic_fetch_add(&ex->stats->exported, 1, __ATOMIC_RELAXED);
+      flags = 0;
+    } else {
+      __atomic_fetch_add(&ex->stats->lagged, 1, __ATOMIC_RELAXED);
+      flags |= RING_REALIGN;
+    }
+    next++;
+  }
+  log_info("Subscriber disconnected, after block no. %u.", next);
+  close(sub->conn);
+  free(sub);
+  return NULL;
+}
 
-/* Set the seed for the RNG. */
-long set_seed() { return -time(NULL); }
+/* Accept subscribers, and stream to each from a thread of its own. */
+void *export_serve(void *arg) {
+  Exporter *ex = (Exporter *)arg;
+  for (;;) {
+    int conn = accept(ex->sock, NULL, NULL);
+    if (conn < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
 
-/* Get a random number from the RNG b/w 0 and 1. */
-double random_deviate(long *seed) {
-  if (*seed < 0) {
-    init_genrand(-(*seed));
-    *seed = 1;
+    /* Give up on a subscriber that stops reading altogether. */
+    struct timeval timeout = {10, 0};
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    Subscriber *sub = (Subscriber *)malloc(sizeof(Subscriber));
+    sub->ex = ex;
+    sub->conn = conn;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, subscribe, sub) != 0) {
+      log_warn("Could not start streaming to a subscriber.");
+      close(conn);
+      free(sub);
+      continue;
+    }
+    pthread_detach(tid);
+    __atomic_fetch_add(&ex->stats->subscribed, 1, __ATOMIC_RELAXED);
+    log_info("Subscriber connected.");
   }
-  return genrand_real1();
+  return NULL;
 }
 
 /* Print Arachne's logo. */
@@ -178,6 +1066,7 @@ void print_logo() {
 int main(int argc, char *argv[]) {
   /* Attach the handler to SIGINT. */
   signal(SIGINT, handler);
+  double tstart = clock_now();
 
   /*==========================================================================*/
   /*========================= ARGUMENT PARSING ===============================*/
@@ -189,6 +1078,9 @@ int main(int argc, char *argv[]) {
   struct arg_lit *version;
   struct arg_lit *verbose;
   struct arg_file *cfgfile;
+  struct arg_file *manifest;
+  struct arg_lit *tune;
+  struct arg_file *benchfile;
   struct arg_end *end;
 
   void *argtable[] = {
@@ -197,6 +1089,9 @@ int main(int argc, char *argv[]) {
       debug = arg_litn("d", NULL, 0, 1, "Activate debugging mode."),
       verbose = arg_litn("v", NULL, 0, 1, "Enable verbose output."),
       cfgfile = arg_file0("c", NULL, "<FILE>", "Specify config file."),
+      manifest = arg_file0("m", NULL, "<FILE>", "Specify burst manifest."),
+      tune = arg_litn("t", "autotune", 0, 1, "Tune for this machine, and exit."),
+      benchfile = arg_file0("b", "bench", "<FILE>", "Benchmark, and exit."),
       frbs = arg_filen(NULL, NULL, "<FRB>", 0, argc + 2, "FRBs to inject."),
       end = arg_end(20),
   };
@@ -253,18 +1148,56 @@ int main(int argc, char *argv[]) {
 
   toml_table_t *opts = toml_table_in(fields, "opts");
   toml_table_t *sys = toml_table_in(fields, "system");
+  toml_table_t *injopts = section(fields, "inject");
 
   toml_datum_t dumpmode = toml_bool_in(opts, "dump");
   toml_datum_t debugmode = toml_bool_in(opts, "debug");
   toml_datum_t verbmode = toml_bool_in(opts, "verbose");
   toml_datum_t debugfile = toml_string_in(opts, "debugfile");
+  toml_datum_t packmode = toml_bool_in(opts, "packed");
+  toml_datum_t verifymode = toml_bool_in(opts, "verify");
+  toml_datum_t truthfile = toml_string_in(opts, "truthfile");
+  toml_datum_t statsfile = toml_string_in(opts, "statsfile");
 
-  toml_datum_t nf = toml_int_in(sys, "nchan");
-  toml_datum_t band = toml_int_in(sys, "band");
-  toml_datum_t dt = toml_double_in(sys, "tsamp");
-  toml_datum_t nantennas = toml_int_in(sys, "nantennas");
   toml_datum_t arraytype = toml_string_in(sys, "arraytype");
 
+  toml_datum_t nphase = toml_int_in(injopts, "phases");
+  toml_datum_t budgetval = toml_double_in(injopts, "budget");
+  toml_datum_t seedval = toml_int_in(injopts, "seed");
+  toml_datum_t ckptfile = toml_string_in(injopts, "checkpoint");
+
+  toml_table_t *ringopts = section(fields, "ring");
+  toml_datum_t inname = toml_string_in(ringopts, "input");
+  toml_datum_t outname = toml_string_in(ringopts, "output");
+  toml_datum_t prefixname = toml_string_in(ringopts, "prefix");
+  toml_datum_t inkeyval = toml_int_in(ringopts, "inkey");
+  toml_datum_t outkeyval = toml_int_in(ringopts, "outkey");
+  toml_datum_t insockname = toml_string_in(ringopts, "insocket");
+  toml_datum_t outsockname = toml_string_in(ringopts, "outsocket");
+  toml_datum_t modeval = toml_int_in(ringopts, "mode");
+  toml_datum_t hugepages = toml_bool_in(ringopts, "hugepages");
+  toml_datum_t staletime = toml_double_in(ringopts, "stale");
+
+  toml_table_t *exportopts = section(fields, "export");
+  toml_datum_t exportmode = toml_bool_in(exportopts, "enable");
+  toml_datum_t exportaddr = toml_string_in(exportopts, "address");
+  toml_datum_t exportport = toml_int_in(exportopts, "port");
+  toml_datum_t exportlag = toml_int_in(exportopts, "backlog");
+  toml_datum_t zerocopy = toml_bool_in(exportopts, "zerocopy");
+
+  toml_table_t *memopts = section(fields, "memory");
+  toml_datum_t membudget = toml_double_in(memopts, "budget");
+  toml_datum_t arenasize = toml_double_in(memopts, "arena");
+
+  toml_table_t *probeopts = section(fields, "probe");
+  toml_datum_t probeevery = toml_int_in(probeopts, "every");
+  toml_datum_t probechan = toml_int_in(probeopts, "channel");
+  toml_datum_t probewidth = toml_int_in(probeopts, "width");
+
+  toml_table_t *tuneopts = section(fields, "tune");
+  toml_datum_t tunedir = toml_string_in(tuneopts, "dir");
+  toml_datum_t tunestart = toml_bool_in(tuneopts, "startup");
+
   /*==========================================================================*/
   /*============================= LOGGING SETUP ==============================*/
   /*==========================================================================*/
@@ -286,38 +1219,7 @@ int main(int argc, char *argv[]) {
   /*========================== CONFIGURATION SETUP ===========================*/
   /*==========================================================================*/
 
-  Config cfg;
-  cfg.nf = (nf.ok) ? nf.u.i : 4096;
-  cfg.dt = (dt.ok) ? dt.u.d : 1.31072e-3;
-  switch (band.u.i) {
-  case 2:
-    log_error("Band 2 not yet supported.");
-    exit(1);
-  case 3:
-    cfg.fl = 300.0;
-    cfg.fh = 500.0;
-    cfg.tsys = 165.0;
-    cfg.antgain = 0.38;
-    break;
-  case 4:
-    cfg.fl = 550.0;
-    cfg.fh = 750.0;
-    cfg.tsys = 100.0;
-    cfg.antgain = 0.32;
-    break;
-  case 5:
-    cfg.fl = 1000.0;
-    cfg.fh = 1400.0;
-    cfg.tsys = 75.0;
-    cfg.antgain = 0.22;
-    break;
-  default:
-    log_error("This band does not exist at the GMRT.");
-    exit(1);
-  }
-  cfg.bw = cfg.fh - cfg.fl;
-  cfg.df = cfg.bw / (double)cfg.nf;
-  cfg.sysgain = cfg.antgain * nantennas.u.i;
+  Config cfg = configure(sys);
 
   log_info("Lowest frequency = %.2f MHz.", cfg.fl);
   log_info("Highest frequency = %.2f MHz.", cfg.fh);
@@ -329,66 +1231,464 @@ int main(int argc, char *argv[]) {
   log_info("Antenna gain = %.2f Jy / K", cfg.antgain);
   log_info("System gain = %.2f Jy / K.", cfg.sysgain);
 
-  /* If debugging, dump data from ring buffer to file. */
-  FILE *dump;
+  /* Find out how to requantize fastest on this machine: from its profile,
+   * if it has one, or else by autotuning, if asked to. Autotuning from
+   * the command line is a one-off: it saves the profile, and exits.
+   */
+  char tunepath[4096];
+  profile_path(tunepath, sizeof(tunepath), (tunedir.ok) ? tunedir.u.s : ".");
+  Tuning tuning = {KERNEL_SWAR, 1, BLKSIZE};
+  bool tuned = (profile_load(tunepath, &tuning) == 0);
+  if ((tune->count > 0) || (!tuned && tunestart.ok && tunestart.u.b)) {
+    log_info("Autotuning, with synthetic blocks of %d bytes.", BLKSIZE);
+    tuning = autotune(BLKSIZE, (int)max(1, sysconf(_SC_NPROCESSORS_ONLN)));
+    if (profile_save(tunepath, tuning) < 0)
+      log_warn("Could not save the tuning profile to %s.", tunepath);
+    if (tune->count > 0) {
+      printf("Tuned: %s kernel, %d threads, %ld byte tiles. Saved to %s.\n",
+             kernel_names[tuning.kernel], tuning.threads, tuning.tile,
+             tunepath);
+      exitcode = 0;
+      goto exit;
+    }
+  } else if (tuned) {
+    log_info("Loaded the tuning profile from %s.", tunepath);
+  }
+  log_info("Requantizing with the %s kernel, %d threads, %ld byte tiles.",
+           kernel_names[tuning.kernel], tuning.threads, tuning.tile);
+  Pool pool;
+  pool_init(&pool, tuning.threads);
+
+  /* Set up the transports for the ring buffers. */
+  int inbackend = ring_backend((inname.ok) ? inname.u.s : "sysv");
+  int outbackend = ring_backend((outname.ok) ? outname.u.s : "sysv");
+  if ((inbackend < 0) || (outbackend < 0)) {
+    log_error("Ring buffers can only use sysv, posix or memfd.");
+    exit(1);
+  }
+  int inkey = (inkeyval.ok) ? inkeyval.u.i : IN_HDRKEY;
+  int outkey = (outkeyval.ok) ? outkeyval.u.i : OUT_HDRKEY;
+  int outmode = (modeval.ok) ? modeval.u.i : 0666;
+  int outflags = SEG_CREATE | ((hugepages.ok && hugepages.u.b) ? SEG_HUGE : 0);
+  double stale = (staletime.ok) ? staletime.u.d : 30.0;
+  const char *prefix = (prefixname.ok) ? prefixname.u.s : "arachne";
+  const char *insocket = (insockname.ok) ? insockname.u.s : "arachne-in.sock";
+  const char *outsocket = (outsockname.ok) ? outsockname.u.s : "arachne.sock";
+
+  /* Account for the memory held by each subsystem, against the budget,
+   * if there is one. The budget is in MB.
+   */
+  Memory mem;
+  memset(&mem, 0, sizeof(Memory));
+  if (membudget.ok) mem.budget = (long)(membudget.u.d * (1L << 20));
+
+  /* Everything that only lives as long as a block comes from an arena,
+   * which grows to fit, if it needs to. Its size is in MB.
+   */
+  Arena arena;
+  arena_init(&arena, (size_t)(((arenasize.ok) ? arenasize.u.d : 64.0) *
+                              (1L << 20)),
+             &mem);
+
+  /* If debugging, dump data from ring buffer to file, and index the
+   * blocks in it, so that they can be found again. Both are opened once
+   * we know whether we are resuming.
+   */
+  FILE *dump = NULL;
+  FILE *dumpidx = NULL;
+  unsigned char *packed = NULL;
+  DumpHead dh = {0};
   if (dumpmode.u.b) {
-    dump = fopen(debugfile.u.s, "w");
-    if (dump == NULL) {
-      log_error("Could not open file.");
+    dh.nchan = cfg.nf;
+    dh.packing = (packmode.ok && packmode.u.b) ? 4 : 1;
+    dh.flipped = (cfg.band == 4);
+    dh.blksize = BLKSIZE / dh.packing;
+    dh.tsamp = cfg.dt;
+    dh.fl = cfg.fl;
+    dh.fh = cfg.fh;
+    if (dh.packing > 1) {
+      packed = (unsigned char *)malloc(dh.blksize);
+      mem_charge(&mem, MEM_DUMP, dh.blksize);
+    }
+  }
+
+  /* If verifying, record the injected bursts in a truth catalog, which is
+   * also opened once we know whether we are resuming.
+   */
+  FILE *truth = NULL;
+  Delays dcache = {0};
+  bool verifying = verifymode.ok && verifymode.u.b;
+
+  /* Build the cache of kernels for sub-sample arrival times. */
+  Kernels kern = kernels((nphase.ok) ? nphase.u.i : 32);
+  log_info("Number of sub-sample phases = %d.", kern.nphase);
+  mem_charge(&mem, MEM_TABLES, kern.nphase * kern.ntap * sizeof(float));
+
+  /* Benchmark each stage, if asked to, and exit. */
+  if (benchfile->count > 0) {
+    bench(*benchfile->filename, cfg, &kern);
+    printf("Wrote benchmark to %s.\n", *benchfile->filename);
+    exitcode = 0;
+    goto exit;
+  }
+
+  /* Synthesize any bursts specified in the configuration file. */
+  toml_array_t *bursts = toml_array_in(fields, "bursts");
+  int nsynth = (bursts) ? toml_array_nelem(bursts) : 0;
+  Burst *synths = (Burst *)calloc(max(1, nsynth), sizeof(Burst));
+  int *priorities = (int *)calloc(max(1, nsynth), sizeof(int));
+  for (int idx = 0; idx < nsynth; ++idx) {
+    toml_table_t *bt = toml_table_at(bursts, idx);
+    toml_datum_t dm = toml_double_in(bt, "dm");
+    toml_datum_t flux = toml_double_in(bt, "flux");
+    toml_datum_t width = toml_double_in(bt, "width");
+    toml_datum_t tburst = toml_double_in(bt, "tburst");
+    toml_datum_t tau = toml_double_in(bt, "tau");
+    toml_datum_t priority = toml_int_in(bt, "priority");
+    if (!(dm.ok && flux.ok && width.ok && tburst.ok)) {
+      log_error("Burst no. %d needs a DM, flux, width and arrival time.", idx);
       exit(1);
     }
+    if ((flux.u.d <= 0.0) || (width.u.d <= 0.0)) {
+      log_error("Burst no. %d needs a positive flux and width.", idx);
+      exit(1);
+    }
+    synths[idx].dm = dm.u.d;
+    synths[idx].flux = flux.u.d;
+    synths[idx].width = width.u.d;
+    synths[idx].tburst = tburst.u.d;
+    synths[idx].tau = (tau.ok) ? tau.u.d : 0.0;
+    priorities[idx] = (priority.ok) ? priority.u.i : 0;
   }
 
+  /* Collect the burst files, from the command line and any manifest. */
+  char **paths = NULL;
+  int npaths = 0;
+  if (manifest->count > 0) {
+    npaths = manifest_read(*manifest->filename, &paths);
+    if (npaths < 0) {
+      log_error("Cannot read manifest %s.", *manifest->filename);
+      exit(1);
+    }
+    log_info("Read %d bursts from manifest %s.", npaths, *manifest->filename);
+  }
+  paths = (char **)realloc(paths, (npaths + frbs->count + 1) * sizeof(char *));
+  for (int idx = 0; idx < frbs->count; ++idx)
+    paths[npaths++] = strdup(frbs->filename[idx]);
+
   /* Check if we injecting something. */
-  if (frbs->count == 0)
+  if ((npaths == 0) && (nsynth == 0))
     log_warn("No FRBs will be injected since none specified.");
 
+  /* Synthesize the bursts, index the burst files, build the table of
+   * transitions and fault in the block to inject into, on the workers,
+   * while we attach to the ring buffers. All of it is done with before
+   * the first block is read.
+   */
+  Table *table = (Table *)malloc(sizeof(Table));
+  unsigned char *raw = (unsigned char *)malloc(BLKSIZE);
+  Span *spans = (Span *)calloc(nsynth + npaths + 1, sizeof(Span));
+  int *status = (int *)calloc(npaths + 1, sizeof(int));
+  double *dms = (double *)calloc(nsynth + npaths + 1, sizeof(double));
+  Warmup warm = {&pool, nsynth + npaths + 3, synths, nsynth, paths, npaths,
+                 cfg, kern.ntap, spans, status, dms, table, raw, &mem, &arena};
+  mem_charge(&mem, MEM_TABLES, sizeof(Table));
+  mem_charge(&mem, MEM_BLOCKS, BLKSIZE);
+  pthread_t warmer;
+  pthread_create(&warmer, NULL, warm_up, &warm);
+
+  /* Set up the budget for injecting into each block. The rates start
+   * out as rough guesses, and are refined as blocks are injected.
+   */
+  int blknt = BLKSIZE / 4096;
+  double blkperiod = blknt * cfg.dt;
+  Budget bud = {0.5 * blkperiod, {2e-7, 5e-8}};
+  if (budgetval.ok) bud.budget = budgetval.u.d * blkperiod;
+  log_info("Injection budget = %.2f s per block.", bud.budget);
+
+  /* Write a latency probe into every so many blocks, if asked to, in the
+   * channels reserved for it.
+   */
+  long probeperiod = (probeevery.ok) ? probeevery.u.i : 0;
+  int probelo = (probechan.ok) ? (int)probechan.u.i : 0;
+  int probenf = (probewidth.ok) ? (int)probewidth.u.i : 4;
+  if ((probeperiod > 0) &&
+      ((probelo < 0) || (probenf < 1) || (probelo + probenf > cfg.nf))) {
+    log_error("Probes must be written into channels that exist.");
+    exit(1);
+  }
+  if (probeperiod > 0)
+    log_info("Probing latency every %ld blocks, in channels %d to %d.",
+             probeperiod, probelo, probelo + probenf - 1);
+
+  Job *jobs = (Job *)calloc(nsynth + npaths + 1, sizeof(Job));
+  int maxslices = SLICES * tuning.threads;
+  Slice *slices = (Slice *)calloc(maxslices, sizeof(Slice));
+  long *counts = (long *)calloc(maxslices, sizeof(long));
+  Burst *files = (Burst *)calloc(npaths + 1, sizeof(Burst));
+  long *lags = (long *)calloc(nsynth + npaths + 1, sizeof(long));
+  long *resume = (long *)calloc(nsynth + npaths + 1, sizeof(long));
+
+  /* The campaign's RNG, and a fingerprint of its bursts, so that a
+   * checkpoint is only ever used for the campaign it was taken of.
+   */
+  Rng rng;
+  rng_seed(&rng, (seedval.ok) ? (uint64_t)seedval.u.i
+                              : (uint64_t)time(NULL) ^ (uint64_t)getpid());
+  uint32_t campaign = 0;
+  for (int idx = 0; idx < nsynth; ++idx) {
+    double params[5] = {synths[idx].dm, synths[idx].flux, synths[idx].width,
+                        synths[idx].tburst, synths[idx].tau};
+    campaign = crc32c(campaign, params, sizeof(params));
+  }
+  for (int idx = 0; idx < npaths; ++idx)
+    campaign = crc32c(campaign, paths[idx], strlen(paths[idx]) + 1);
+
   /*==========================================================================*/
   /*======================= SHARED MEMORY SHENANIGANS ========================*/
   /*==========================================================================*/
 
-  unsigned char *raw = (unsigned char *)malloc(BLKSIZE);
-
   int recNumRead = 0;
   int recNumWrite = 0;
-  int currentReadBlock = 0;
-
-  int idHdrRead = shmget(IN_HDRKEY, sizeof(Header), SHM_RDONLY);
-  int idBufRead = shmget(IN_BUFKEY, sizeof(Buffer), SHM_RDONLY);
-  if (idHdrRead < 0 || idBufRead < 0) {
+  unsigned int currentReadBlock = 0;
+  unsigned int blkflags = 0;
+
+  Input in = {.backend = inbackend,
+              .key = inkey,
+              .prefix = prefix,
+              .socket = insocket};
+  if (input_attach(&in) < 0) {
     log_error("Shared memory does not exist.");
     exit(1);
   }
-
-  Header *HdrRead = (Header *)shmat(idHdrRead, 0, 0);
-  Buffer *BufRead = (Buffer *)shmat(idBufRead, 0, 0);
-  if ((BufRead) == (Buffer *)-1) {
-    log_error("Could not attach to shared memory.");
-    exit(1);
-  } else {
-    log_info("Attached to shared memory with id = %d.", idBufRead);
-  }
-
-  int idHdrWrite = shmget(OUT_HDRKEY, sizeof(Header), IPC_CREAT | 0666);
-  int idBufWrite = shmget(OUT_BUFKEY, sizeof(Buffer), IPC_CREAT | 0666);
-  if (idHdrWrite < 0 || idBufWrite < 0) {
+  Header *HdrRead = (Header *)in.hdr.addr;
+  Buffer *BufRead = (Buffer *)in.buf.addr;
+  log_info("Attached to shared memory with id = %d.", in.buf.id);
+
+  /* Start with the producer's next block, wherever its counter is. */
+  currentReadBlock = BufRead->curr_blk;
+  recNumRead = BufRead->curr_rec % MAXBLKS;
+
+  Segment SegHdrWrite, SegBufWrite;
+  if ((seg_open(&SegHdrWrite, outbackend, prefix, outkey, sizeof(RingHeader),
+                outflags, outmode) < 0) ||
+      (seg_open(&SegBufWrite, outbackend, prefix, outkey + 1, sizeof(Buffer),
+                outflags, outmode) < 0)) {
     log_error("Could not create shared memory.");
     exit(1);
   }
 
-  Header *HdrWrite = (Header *)shmat(idHdrWrite, 0, 0);
-  Buffer *BufWrite = (Buffer *)shmat(idBufWrite, 0, 0);
-  if ((BufWrite) == (Buffer *)-1) {
-    log_error("Could not attach to shared memory.");
+  RingHeader *HdrWrite = (RingHeader *)SegHdrWrite.addr;
+  Buffer *BufWrite = (Buffer *)SegBufWrite.addr;
+  log_info("Created another shared memory with id = %d.", SegBufWrite.id);
+
+  /* Whatever cannot be done without has to fit in the budget. Bursts
+   * being synthesized meanwhile can be evicted, so they do not count.
+   */
+  mem_charge(&mem, MEM_RING, SegHdrWrite.size + SegBufWrite.size);
+  if (verifying) mem_charge(&mem, MEM_TABLES, NDELAYS * cfg.nf * 4L);
+  if ((mem.budget > 0) && (mem_fixed(&mem) > mem.budget)) {
+    log_error("The memory budget (%.1f MB) is less than the %.1f MB that "
+              "arachne cannot do without.",
+              mem.budget / 1048576.0, mem_fixed(&mem) / 1048576.0);
     exit(1);
-  } else {
-    log_info("Created another shared memory with id = %d.", idBufWrite);
+  }
+  if (mem.budget > 0)
+    log_info("Memory budget = %.1f MB, of which %.1f MB is fixed.",
+             mem.budget / 1048576.0, mem_fixed(&mem) / 1048576.0);
+
+  /* Serve the memfds to consumers that connect to the socket. */
+  Server server = {-1, &SegHdrWrite, &SegBufWrite};
+  if (outbackend == RING_MEMFD) {
+    server.sock = ring_listen(outsocket);
+    if (server.sock < 0) {
+      log_error("Could not listen on %s.", outsocket);
+      exit(1);
+    }
+    pthread_t tid;
+    pthread_create(&tid, NULL, serve, &server);
+    pthread_detach(tid);
+    log_info("Serving shared memory on %s.", outsocket);
   }
 
   BufWrite->curr_rec = 0;
   BufWrite->curr_blk = 0;
   recNumWrite = (BufWrite->curr_rec) % MAXBLKS;
-  HdrWrite->active = 1;
+  memset(HdrWrite->seq, 0, sizeof(HdrWrite->seq));
+  memset(HdrWrite->blkno, 0xff, sizeof(HdrWrite->blkno));
+  HdrWrite->magic = RING_MAGIC;
+  HdrWrite->hdr.active = 1;
+
+  /* Fault in the output ring buffer, so that the first pass through its
+   * slots does not pay for it.
+   */
+  seg_prefault(&SegBufWrite);
+
+  /* Index the bursts by where they fall in the timeline, so that blocks
+   * without any can be told apart at a glance. Burst files are mapped,
+   * so only the pages with their first and last rows were read.
+   */
+  pthread_join(warmer, NULL);
+  int nspans = 0;
+  for (int idx = 0; idx < nsynth; ++idx)
+    log_info("Synthesized burst no. %d with DM = %.2f pc cm^-3, %ld samples.",
+             idx, synths[idx].dm, synths[idx].nnz);
+  for (int idx = 0; idx < npaths; ++idx) {
+    if (status[idx] < 0)
+      log_warn("Cannot read burst from %s.", paths[idx]);
+    else if (status[idx] > 0)
+      log_warn("Cannot inject since no burst in %s.", paths[idx]);
+  }
+  for (int id = 0; id < nsynth + npaths; ++id)
+    if (spans[id].id >= 0) spans[nspans++] = spans[id];
+  qsort(spans, nspans, sizeof(Span), by_start);
+  log_info("Indexed %d bursts.", nspans);
+
+  /* The workers kept the bursts they synthesized as long as there was
+   * room, but the bursts to keep are the ones that come up first.
+   */
+  evict(&mem, 0, synths, nsynth, spans, nspans, LONG_MIN);
+  if (mem.shed[MEM_BURSTS] > 0)
+    log_warn("Evicted %lu bursts, to stay within the memory budget. They "
+             "will be synthesized again when they come up.",
+             mem.shed[MEM_BURSTS]);
+
+  /* Build the delay tables for verifying bursts ahead of time, for as
+   * many as the cache has room for, and make room for the rest, so that
+   * replacing them later does not allocate.
+   */
+  if (verifying) delays_init(&dcache, cfg);
+  for (int id = 0; verifying && (id < nsynth + npaths); ++id)
+    if (dcache.count < NDELAYS) delays(&dcache, dms[id], cfg);
+
+  Stats stats;
+  memset(&stats, 0, sizeof(Stats));
+  stats.mem = &mem;
+
+  /* Pick up the campaign where it left off, if there is a checkpoint of
+   * it. Bursts that were not done with are moved on by as many blocks as
+   * the input moved on by in the meantime, so the campaign carries on
+   * with the very next block, as if it had never stopped. Those that
+   * were partly injected pick up from their first sample that was not,
+   * and none of what was injected before is injected again. The output's
+   * blocks are numbered on from the last one published.
+   */
+  Checkpoint ckpt;
+  CkptHead head = {0};
+  head.campaign = campaign;
+  head.nbursts = nspans;
+  Cursor *cursors = (Cursor *)calloc(nspans + 1, sizeof(Cursor));
+  bool resumed = false;
+  if (ckptfile.ok) {
+    CkptHead *last = ckpt_load(ckptfile.u.s);
+    if ((last != NULL) &&
+        ((last->campaign != campaign) || (last->nbursts != head.nbursts))) {
+      log_warn("Checkpoint %s is of another campaign, starting afresh.",
+               ckptfile.u.s);
+    } else if (last != NULL) {
+      int gap = (int)(currentReadBlock - last->inblk);
+      Cursor *saved = (Cursor *)(last + 1);
+      for (uint32_t k = 0; k < last->nbursts; ++k) {
+        int id = saved[k].id;
+        if ((id < 0) || (id >= nsynth + npaths)) continue;
+        lags[id] = saved[k].moved + ((saved[k].done) ? 0 : gap);
+        if (id < nsynth) synths[id].tburst += lags[id] * blkperiod;
+        for (int j = 0; j < nspans; ++j) {
+          if (spans[j].id != id) continue;
+          spans[j].beg += lags[id] * blknt;
+          spans[j].end += lags[id] * blknt;
+          resume[id] = spans[j].beg + saved[k].next;
+        }
+      }
+      qsort(spans, nspans, sizeof(Span), by_start);
+      rng = last->rng;
+      head.serial = last->serial;
+      BufWrite->curr_blk = last->outblk;
+      BufWrite->curr_rec = last->outblk % MAXBLKS;
+      recNumWrite = BufWrite->curr_rec;
+      blkflags |= RING_DISCONT;
+      resumed = true;
+      log_info("Resumed from checkpoint no. %lu, %d blocks on, publishing "
+               "from block no. %u.",
+               (unsigned long)last->serial, gap, last->outblk);
+    }
+    free(last);
+    if (ckpt_open(&ckpt, ckptfile.u.s, &mem) < 0) {
+      log_error("Could not open checkpoint %s.", ckptfile.u.s);
+      exit(1);
+    }
+  }
+
+  /* When resuming, the dump, its index and the truth catalog are added
+   * to, rather than started afresh, so that what was published before
+   * is kept. Blocks published after the checkpoint are published again,
+   * so they are cut off the dump and its index first.
+   */
+  if (dumpmode.u.b && resumed) {
+    long size = 0;
+    dumpidx = dumpidx_resume(debugfile.u.s, &dh, BufWrite->curr_blk, &size);
+    if (dumpidx == NULL) {
+      log_error("Cannot resume over %s, since its index is missing, or is "
+                "of another kind of dump.",
+                debugfile.u.s);
+      exit(1);
+    }
+    if (truncate(debugfile.u.s, size) == 0)
+      dump = fopen(debugfile.u.s, "a");
+  } else if (dumpmode.u.b) {
+    dump = fopen(debugfile.u.s, "w");
+    dumpidx = dumpidx_create(debugfile.u.s, &dh);
+    if (dumpidx == NULL) {
+      log_error("Could not open the index of %s.", debugfile.u.s);
+      exit(1);
+    }
+  }
+  if (dumpmode.u.b && (dump == NULL)) {
+    log_error("Could not open file.");
+    exit(1);
+  }
+  if (verifying) {
+    truth = fopen((truthfile.ok) ? truthfile.u.s : "truth.txt",
+                  (resumed) ? "a" : "w");
+    if (truth == NULL) {
+      log_error("Could not open truth catalog.");
+      exit(1);
+    }
+    if (!resumed)
+      fprintf(truth, "# blk id dm flux width tburst tau intended achieved "
+                     "coverage\n");
+  }
+
+  /* Stream the output ring buffer to subscribers over TCP, if asked to.
+   * A subscriber's backlog is capped, so that the slots it is sent from
+   * are never the ones we are writing to.
+   */
+  Exporter exporter = {.sock = -1,
+                       .backlog = 4,
+                       .zerocopy = true,
+                       .hdr = HdrWrite,
+                       .buf = BufWrite,
+                       .stats = &stats};
+  pthread_mutex_init(&exporter.lock, NULL);
+  pthread_cond_init(&exporter.cond, NULL);
+  if (exportmode.ok && exportmode.u.b) {
+    const char *addr = (exportaddr.ok) ? exportaddr.u.s : "0.0.0.0";
+    int port = (exportport.ok) ? exportport.u.i : EXPORT_PORT;
+    if (exportlag.ok) exporter.backlog = clip(exportlag.u.i, 1, MAXBLKS - 2);
+    if (zerocopy.ok) exporter.zerocopy = zerocopy.u.b;
+    exporter.sock = export_listen(addr, port);
+    if (exporter.sock < 0) {
+      log_error("Could not listen on %s:%d.", addr, port);
+      exit(1);
+    }
+    pthread_t tid;
+    pthread_create(&tid, NULL, export_serve, &exporter);
+    pthread_detach(tid);
+    log_info("Exporting on %s:%d, with a backlog of %d blocks.", addr, port,
+             exporter.backlog);
+  }
+  stats.ready = clock_now() - tstart;
+  log_info("Ready in %.3f s.", stats.ready);
 
   /*==========================================================================*/
   /*======================== MAIN EXECUTION LOOP =============================*/
@@ -396,160 +1696,366 @@ int main(int argc, char *argv[]) {
 
   while (keep) {
     int flag = 0;
+    long polls = 0;
+    bool restarted = false;
     while (currentReadBlock == BufRead->curr_blk) {
       usleep(2000);
       if (flag == 0) {
         log_debug("Waiting...");
         flag = 1;
       }
+
+      /* Check on the producer about once a second. */
+      if ((++polls % 500 == 0) && input_replaced(&in, polls * 2e-3, stale)) {
+        restarted = true;
+        break;
+      }
     }
     if (flag == 1) log_debug("Ready!");
-
-    int blknt = BLKSIZE / 4096;
-    long blkbeg = (long)currentReadBlock * (long)BLKSIZE;
-    long blkend = (long)(currentReadBlock + 1) * (long)BLKSIZE;
-    double blktime = blknt * cfg.dt * (double)currentReadBlock;
-    log_debug("Reading block no. %d, t = %.2lf s.", currentReadBlock, blktime);
+    double tready = clock_now();
+    uint64_t seen = probe_now();
+    HdrRead = (Header *)in.hdr.addr;
+    BufRead = (Buffer *)in.buf.addr;
+
+    /* A producer that restarts in place starts counting from zero again. */
+    if ((int)(BufRead->curr_blk - currentReadBlock) < 0) restarted = true;
+
+    /* After a restart, pick up from the producer's next block, and mark
+     * the discontinuity on the first block we publish after it.
+     */
+    if (restarted) {
+      currentReadBlock = BufRead->curr_blk;
+      recNumRead = BufRead->curr_rec % MAXBLKS;
+      blkflags |= RING_DISCONT;
+      stats.reattaches++;
+      log_warn("Producer restarted, resuming from block no. %u.",
+               currentReadBlock);
+      if (statsfile.ok) stats_write(&stats, statsfile.u.s);
+      continue;
+    }
 
     if (BufRead->curr_blk - currentReadBlock >= MAXBLKS - 1) {
       log_debug("Realigning...");
       recNumRead = (BufRead->curr_rec - 1 + MAXBLKS) % MAXBLKS;
+      stats.dropped += BufRead->curr_blk - 1 - currentReadBlock;
       currentReadBlock = BufRead->curr_blk - 1;
+      blkflags |= RING_REALIGN;
+      stats.realigns++;
     }
 
-    memcpy(raw, BufRead->data + (long)BLKSIZE * (long)recNumRead, BLKSIZE);
-
-    /*==================================================================*/
-    /*======================== REQUANTIZATION ==========================*/
-    /*==================================================================*/
-
-    unsigned char temp = 0;
-    for (int i = 0; i < BLKSIZE; i = i + 4) {
-      temp = ((((raw[i + 0] << 2) & 0xc0) >> 6) & 0x03) |
-             ((((raw[i + 1] << 2) & 0xc0) >> 4) & 0x0c) |
-             ((((raw[i + 2] << 2) & 0xc0) >> 2) & 0x30) |
-             ((((raw[i + 3] << 2) & 0xc0)));
-      raw[i + 3] = (temp & 0x03);
-      raw[i + 2] = (temp & 0x0c) >> 2;
-      raw[i + 1] = (temp & 0x30) >> 4;
-      raw[i + 0] = (temp & 0xc0) >> 6;
+    long blkbeg = (long)currentReadBlock * (long)BLKSIZE;
+    long blkend = (long)(currentReadBlock + 1) * (long)BLKSIZE;
+    double blktime = blknt * cfg.dt * (double)currentReadBlock;
+    log_debug("Reading block no. %u, t = %.2lf s.", currentReadBlock, blktime);
+    arena_reset(&arena);
+
+    /* Once a block has been injected into and another streamed, every
+     * path through the loop has been warmed up, and nothing after should
+     * allocate. Builds that trace allocations check that it does not.
+     */
+    if ((stats.injected > 0) && (stats.streamed > 0)) trace_arm();
+
+    /* Blocks that no burst touches, which is most of them, need nothing
+     * but requantizing, so they are requantized straight from the input
+     * ring buffer into the output's. Others are requantized into a block
+     * of our own, to inject into, and copied out after. Either way, the
+     * block's CRC is taken in the same pass that writes it out.
+     */
+    bool busy = index_busy(spans, nspans, blkbeg / cfg.nf, blkend / cfg.nf);
+    unsigned char *out = BufWrite->data + (long)BLKSIZE * (long)recNumWrite;
+    unsigned char *dst = (busy) ? raw : out;
+    if (!busy) ring_write_begin(HdrWrite, recNumWrite);
+
+    /* Snapshot the producer's state before and after copying the slot.
+     * The producer only starts overwriting our slot once it has moved
+     * on to the block MAXBLKS ahead of ours, and it stamps the slot with
+     * a new time when it does. If either happens while we were copying,
+     * the copy may be torn, and the block is discarded.
+     */
+    unsigned int blkbefore =
+        __atomic_load_n(&BufRead->curr_blk, __ATOMIC_ACQUIRE);
+    double timebefore = BufRead->datatime[recNumRead];
+    struct timeval stamp = HdrRead->timestamp[recNumRead];
+    struct timeval gps = HdrRead->timestamp_gps[recNumRead];
+    uint32_t crc = 0;
+    pool_run(&pool, kernel_fns[tuning.kernel], dst,
+             BufRead->data + (long)BLKSIZE * (long)recNumRead, BLKSIZE,
+             tuning.tile, (busy) ? NULL : &crc);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    unsigned int blkafter =
+        __atomic_load_n(&BufRead->curr_blk, __ATOMIC_ACQUIRE);
+    double timeafter = BufRead->datatime[recNumRead];
+
+    if ((blkafter - currentReadBlock >= MAXBLKS) ||
+        (timeafter != timebefore)) {
+      log_warn("Discarding block no. %u, torn while reading (%u -> %u).",
+               currentReadBlock, blkbefore, blkafter);
+      if (!busy) ring_write_abort(HdrWrite, recNumWrite);
+      blkflags |= RING_REALIGN;
+      stats.torn++;
+      stats.dropped++;
+      recNumRead = (recNumRead + 1) % MAXBLKS;
+      currentReadBlock++;
+      if (statsfile.ok) stats_write(&stats, statsfile.u.s);
+      continue;
     }
 
     /*==================================================================*/
     /*======================== FRB INJECTION ===========================*/
     /*==================================================================*/
 
-    if (frbs->count > 0) {
-      for (int idx = 0; idx < frbs->count; ++idx) {
-        /* Get the burst's data and metadata. */
-        FILE *bf = fopen(frbs->filename[idx], "r");
-
-        long M, N, nnz = 0;
-        double dm, flux, width, tburst;
-
-        fread(&M, sizeof(long), 1, bf);
-        fread(&N, sizeof(long), 1, bf);
-        fread(&nnz, sizeof(long), 1, bf);
-        fread(&dm, sizeof(double), 1, bf);
-        fread(&flux, sizeof(double), 1, bf);
-        fread(&width, sizeof(double), 1, bf);
-        fread(&tburst, sizeof(double), 1, bf);
+    DumpEntry entry;
+    memset(&entry, 0, sizeof(DumpEntry));
+    if (busy) {
+      /* Gather the bursts that fall in this block, from the index. Burst
+       * files are read again, and moved by however long they have been
+       * deferred for, and evicted bursts are synthesized again. Both go
+       * into the block's arena, and are let go of with the block.
+       */
+      int njobs = 0;
+      for (int k = 0; (k < nspans) && (spans[k].beg < blkend / cfg.nf); ++k) {
+        if (spans[k].end <= blkbeg / cfg.nf) continue;
+        int id = spans[k].id;
+        Burst *b = (id < nsynth) ? &synths[id] : &files[id - nsynth];
+        Job *job = &jobs[njobs];
+        job->b = b;
+        job->id = id;
+        job->priority = (id < nsynth) ? priorities[id] : 0;
+        job->count = 0;
+        job->started = false;
+        job->deferred = false;
+        job->from = resume[id] * cfg.nf;
+
+        /* Make room for the burst by evicting bursts further ahead. If
+         * there is still none, it is deferred, unless it has started. An
+         * evicted burst is only synthesized again if it fits, or if it
+         * may have started, since it is as large as it was before.
+         */
+        bool fits = true;
+        if (id >= nsynth) {
+          if (burst_read(paths[id - nsynth], b, &arena) < 0) {
+            log_warn("Cannot read burst from %s.", paths[id - nsynth]);
+            continue;
+          }
+          b->tburst += lags[id] * blkperiod;
+          shift(b, &kern, cfg);
+          mem_charge(&mem, MEM_BURSTS, burst_bytes(b));
+        } else if (b->rows == NULL) {
+          long size = b->nnz * (long)(2 * sizeof(int) + sizeof(float));
+          fits = evict(&mem, size, synths, nsynth, spans, nspans,
+                       blkend / cfg.nf) ||
+                 (spans[k].beg < blkbeg / cfg.nf);
+          if (fits) {
+            b->arena = &arena;
+            synthesize(b, cfg);
+          }
+        }
+        if (fits) {
+          job->count = burst_count(b, cfg, max(blkbeg, job->from), blkend,
+                                   &job->started);
+          if (job->count == 0) {
+            if (b->arena != NULL) burst_release(b, &mem);
+            continue;
+          }
+          fits = evict(&mem, 0, synths, nsynth, spans, nspans,
+                       blkend / cfg.nf) ||
+                 job->started;
+        }
+        njobs++;
+        if (fits) continue;
+        burst_release(b, &mem);
+        job->deferred = true;
+        stats.deferred++;
+        log_warn("Deferring burst no. %d from block no. %u, for lack of "
+                 "memory.",
+                 id, currentReadBlock);
+      }
 
-        if (nnz == 0) {
-          log_warn("Cannot inject since no burst in the file.");
+      /* Inject within the budget, which counts from when the block came
+       * in. The bursts that are not deferred are injected by the pool, a
+       * slice of the block at a time, with about as much work in every
+       * slice. Deferred bursts are moved to the same time in the next
+       * block, and so are their places in the index.
+       */
+      double left = bud.budget - (clock_now() - tready);
+      bool fast = schedule(jobs, njobs, &bud, left, &stats, currentReadBlock);
+      bool moved = false;
+      for (int j = 0; j < njobs; ++j) {
+        Job *job = &jobs[j];
+        if (!job->deferred) {
+          if (entry.nbursts < DUMPIDX_MAXIDS)
+            entry.ids[entry.nbursts] = job->id;
+          entry.nbursts++;
           continue;
         }
-
-        int *rows = (int *)malloc(nnz * sizeof(int));
-        int *cols = (int *)malloc(nnz * sizeof(int));
-        float *fluxes = (float *)malloc(nnz * sizeof(float));
-        for (int i = 0; i < nnz; ++i) fread(&rows[i], sizeof(int), 1, bf);
-        for (int i = 0; i < nnz; ++i) fread(&cols[i], sizeof(int), 1, bf);
-        for (int i = 0; i < nnz; ++i) fread(&fluxes[i], sizeof(float), 1, bf);
-
-        long seed = set_seed();                /* Set the seed for injection. */
-        long offset = (long)(tburst / cfg.dt); /* Burst offset. */
-        double sigma =
-            cfg.tsys / cfg.sysgain /
-            sqrt(2 * cfg.dt * (cfg.df * 1e6)); /* Ideal RMS calculation. */
-
-        /* Begin injection. */
-        for (int i = 0; i < nnz; ++i) {
-          long I = (offset + (long)rows[i]) * (long)cfg.nf;
-
-          /* Flip the band if it is Band 4 at the GMRT, otherwise do nothing. */
-          if (band.u.i == 4)
-            I += (cfg.nf - 1 - (long)cols[i]);
-          else
-            I += (long)cols[i];
-
-          if ((I <= blkbeg) || (I >= blkend)) break;
-          I = I % (long)BLKSIZE;
-          int in = raw[I];
-          int out;
-
-          double lvl = 1;
-          double plvl1, plvl2, plvl3;
-          double signal = fluxes[i] / sigma;
-          double pval = random_deviate(&seed);
-
-          if (in == 3)
-            out = 3;
-          else if (in == 2) {
-            plvl1 = (prob(max(0, lvl - signal)) - 0.5) / (prob(lvl) - 0.5);
-            if (pval < plvl1)
-              out = 2;
-            else
-              out = 3;
-          } else if (in == 1) {
-            plvl1 =
-                (0.5 - prob(clip(-lvl, 0, lvl - signal))) / (0.5 - prob(-lvl));
-            plvl2 = plvl1 + (prob(clip(-lvl, 0, lvl - signal)) -
-                             prob(max(-signal, -lvl))) /
-                                (0.5 - prob(-lvl));
-            if (pval < plvl1)
-              out = 3;
-            else if (pval < plvl2)
-              out = 2;
-            else
-              out = 1;
-          } else if (in == 0) {
-            plvl1 = (prob(-lvl) - prob(min(-signal + lvl, -lvl))) / prob(-lvl);
-            plvl2 = plvl1 + (prob(min(-signal + lvl, -lvl)) -
-                             prob(min(-signal, -lvl))) /
-                                prob(-lvl);
-            plvl3 = plvl2 + (prob(min(-signal, -lvl)) - prob(-lvl - signal)) /
-                                prob(-lvl);
-            if (pval < plvl1)
-              out = 3;
-            else if (pval < plvl2)
-              out = 2;
-            else if (pval < plvl3)
-              out = 1;
-            else
-              out = 0;
-          }
-          raw[I] = out;
+        if (job->id < nsynth) synths[job->id].tburst += blkperiod;
+        lags[job->id]++;
+        for (int k = 0; k < nspans; ++k) {
+          if (spans[k].id != job->id) continue;
+          spans[k].beg += blknt;
+          spans[k].end += blknt;
         }
-        free(rows);
-        free(cols);
-        free(fluxes);
-        fclose(bf);
+        moved = true;
+      }
+
+      double t0 = clock_now();
+      Injection injection = {raw,    jobs,           njobs, cfg, blkbeg, NULL,
+                             slices, rng_next(&rng), counts};
+      if (fast) injection.table = table;
+      int nslices = slices_split(jobs, njobs, cfg, blkbeg, blkend, slices,
+                                 maxslices);
+      pool_each(&pool, inject_slice, &injection, nslices);
+      double spent = clock_now() - t0;
+      long ninjected = 0;
+      for (int k = 0; k < nslices; ++k) ninjected += counts[k];
+
+      for (int j = 0; j < njobs; ++j)
+        if (truth && !jobs[j].deferred)
+          record(truth, raw, jobs[j].b, jobs[j].id, &dcache, &arena, cfg,
+                 blkbeg, blkend, currentReadBlock);
+      for (int j = 0; j < njobs; ++j)
+        if (jobs[j].b->arena != NULL) burst_release(jobs[j].b, &mem);
+      if (moved) index_sort(spans, nspans);
+
+      /* Synthesized bursts are let go of once they are done with. */
+      for (int k = 0; (k < nspans) && (spans[k].beg < blkend / cfg.nf); ++k)
+        if ((spans[k].id < nsynth) && (spans[k].end <= blkend / cfg.nf))
+          burst_release(&synths[spans[k].id], &mem);
+
+      if (ninjected >= 1000)
+        bud.rate[fast] = 0.8 * bud.rate[fast] + 0.2 * spent / ninjected;
+      if (spent > max(left, 0.0)) {
+        stats.overruns++;
+        log_warn("Injecting block no. %u took %.2f s, over its %.2f s "
+                 "budget.",
+                 currentReadBlock, spent, max(left, 0.0));
       }
+
+      ring_write_begin(HdrWrite, recNumWrite);
+      pool_run(&pool, copy, out, raw, BLKSIZE, tuning.tile, &crc);
+      stats.injected++;
+    } else {
+      stats.streamed++;
     }
 
-    if (dumpmode.u.b) fwrite(raw, 1, BLKSIZE, dump);
-    memcpy(BufWrite->data + (long)BLKSIZE * (long)recNumWrite, raw, BLKSIZE);
+    /* Write a latency probe into the block, if it is due one, stamped
+     * with when the producer wrote the block, or else with when we saw
+     * it. Only the spectra it is written into are checksummed again.
+     */
+    if ((probeperiod > 0) && (BufWrite->curr_blk % probeperiod == 0)) {
+      Probe pr = {(unsigned int)stats.probes, seen, 0};
+      if (stamp.tv_sec > 0)
+        pr.stamp = (uint64_t)stamp.tv_sec * 1000000 + stamp.tv_usec;
+      long len = (long)PROBE_NBITS * cfg.nf;
+      uint32_t before = crc32c(0, out, len);
+      probe_write(out, cfg.nf, probelo, probenf, &pr);
+      crc = crc32c_patch(crc, before, crc32c(0, out, len), BLKSIZE - len);
+      stats.probes++;
+      log_debug("Probe no. %u written into block no. %u.", pr.seq,
+                BufWrite->curr_blk);
+    }
+    if (dumpmode.u.b) {
+      entry.offset = ftell(dump);
+      entry.blkno = BufWrite->curr_blk;
+      entry.inblk = currentReadBlock;
+      entry.gps = gps.tv_sec + gps.tv_usec * 1e-6;
+      entry.datatime = timebefore;
+      entry.flags = blkflags;
+      entry.crc = crc;
+      entry.slot = recNumWrite;
+      if (packed) {
+        dumpidx_pack(packed, out, BLKSIZE);
+        fwrite(packed, 1, BLKSIZE / 4, dump);
+      } else {
+        fwrite(out, 1, BLKSIZE, dump);
+      }
+      fflush(dump);
+      dumpidx_append(dumpidx, &entry);
+    }
 
     recNumRead = (recNumRead + 1) % MAXBLKS;
     currentReadBlock++;
 
-    BufWrite->curr_rec = (recNumWrite + 1) % MAXBLKS;
-    BufWrite->curr_blk += 1;
+    ring_write_end(HdrWrite, BufWrite, recNumWrite, BufWrite->curr_blk,
+                   blkflags, crc);
+    if (exporter.sock >= 0) {
+      pthread_mutex_lock(&exporter.lock);
+      pthread_cond_broadcast(&exporter.cond);
+      pthread_mutex_unlock(&exporter.lock);
+    }
+    blkflags = 0;
     recNumWrite = (recNumWrite + 1) % MAXBLKS;
+
+    /* The latency is measured from when the producer stamped the block,
+     * if it does, to when we published it.
+     */
+    if (stamp.tv_sec > 0) {
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      stats.latency = (now.tv_sec - stamp.tv_sec) +
+                      (now.tv_usec - stamp.tv_usec) * 1e-6;
+      stats.maxlatency = max(stats.maxlatency, stats.latency);
+    }
+
+    if (stats.blocks == 0) {
+      stats.firstblock = clock_now() - tready;
+      log_info("Published the first block in %.3f s.", stats.firstblock);
+    }
+    stats.blocks++;
+    if (statsfile.ok) stats_write(&stats, statsfile.u.s);
+
+    /* Checkpoint the campaign, now that the block is out. Bursts further
+     * ahead are evicted first, if the queue would have no room.
+     */
+    if (ckptfile.ok) {
+      evict(&mem, ckpt_size(nspans), synths, nsynth, spans, nspans,
+            (long)currentReadBlock * blknt);
+      head.serial++;
+      head.inblk = currentReadBlock;
+      head.outblk = BufWrite->curr_blk;
+      head.rng = rng;
+      for (int k = 0; k < nspans; ++k) {
+        long upto = min((long)currentReadBlock * blknt, spans[k].end);
+        cursors[k].id = spans[k].id;
+        cursors[k].done = (spans[k].end <= (long)currentReadBlock * blknt);
+        cursors[k].moved = lags[spans[k].id];
+        cursors[k].next = max(upto - spans[k].beg, 0);
+      }
+      ckpt_push(&ckpt, &head, cursors);
+    }
   }
+  trace_disarm();
+#ifdef ARACHNE_TRACE
+  if (trace_allocs() > 0)
+    log_warn("Allocated %lu times in the main loop, after warming up.",
+             trace_allocs());
+#endif
   free(raw);                      /* Free the memory allocated for data. */
-  if (dumpmode.u.b) fclose(dump); /* Close the file opened for debugging. */
+  arena_free(&arena);
+  pool_free(&pool);
+  for (int idx = 0; idx < nsynth; ++idx) burst_free(&synths[idx]);
+  for (int idx = 0; idx < npaths; ++idx) free(paths[idx]);
+  free(synths);
+  free(priorities);
+  free(paths);
+  free(jobs);
+  free(slices);
+  free(counts);
+  free(files);
+  free(lags);
+  free(resume);
+  free(cursors);
+  free(status);
+  free(dms);
+  if (ckptfile.ok) ckpt_close(&ckpt);
+  free(spans);
+  free(table);
+  free(kern.w);
+  if (dump) fclose(dump);         /* Close the file opened for debugging. */
+  if (dumpidx) fclose(dumpidx);   /* Close the index of the dump. */
+  free(packed);
+  if (truth) fclose(truth);       /* Close the truth catalog. */
+  delays_free(&dcache);
 
 /* Free up memory if and when the argument parsing exits. */
 exit:
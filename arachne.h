@@ -0,0 +1,118 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  Definitions shared by arachne and its tools.
+ */
+
+#ifndef ARACHNE_H
+#define ARACHNE_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* External libraries. */
+#include "extern/log.h"  // For logging.
+#include "extern/toml.h" // For parsing TOML files.
+
+/* Arachne's version number. */
+#define ARACHNE_VERSION "0.1.0"
+
+/* Struct to store program configuration. */
+typedef struct {
+  int nf;         // Number of channels.
+  double fl;      // Lowest frequency.
+  double fh;      // Highest frequency.
+  double dt;      // Sampling time.
+  double df;      // Channel width.
+  double bw;      // Bandwidth.
+  double tsys;    // System temperature.
+  double antgain; // Antenna gain.
+  double sysgain; // System gain.
+  int band;       // Observing band.
+} Config;
+
+/* Find the lesser of two numbers. */
+static inline double min(double x1, double x2) {
+  if (x1 < x2) return x1;
+  return x2;
+}
+
+/* Find the greater of two numbers. */
+static inline double max(double x1, double x2) {
+  if (x1 > x2) return x1;
+  return x2;
+}
+
+/* Clip a number b/w two values. */
+static inline double clip(double x, double x1, double x2) {
+  if (x >= x1 && x < x2) return x;
+  if (x < x1) return x1;
+  return x2;
+}
+
+/* Find the probability of a Gaussian random variable. */
+static inline double prob(double x) { return 0.5 + 0.5 * erf(x / sqrt(2)); }
+
+/* Get a table from the configuration file. Optional tables that are
+ * missing are returned as empty tables, so that defaults kick in.
+ */
+static inline toml_table_t *section(toml_table_t *fields, const char *key) {
+  char empty[] = "";
+  char errbuf[200];
+  toml_table_t *tab = toml_table_in(fields, key);
+  if (tab == NULL) tab = toml_parse(empty, errbuf, sizeof(errbuf));
+  return tab;
+}
+
+/* Set up the configuration for a given band at the GMRT, from the
+ * "system" table of the configuration file.
+ */
+static inline Config configure(toml_table_t *sys) {
+  toml_datum_t nf = toml_int_in(sys, "nchan");
+  toml_datum_t band = toml_int_in(sys, "band");
+  toml_datum_t dt = toml_double_in(sys, "tsamp");
+  toml_datum_t nantennas = toml_int_in(sys, "nantennas");
+
+  Config cfg;
+  cfg.nf = (nf.ok) ? nf.u.i : 4096;
+  cfg.dt = (dt.ok) ? dt.u.d : 1.31072e-3;
+  switch (band.u.i) {
+  case 2:
+    log_error("Band 2 not yet supported.");
+    exit(1);
+  case 3:
+    cfg.fl = 300.0;
+    cfg.fh = 500.0;
+    cfg.tsys = 165.0;
+    cfg.antgain = 0.38;
+    break;
+  case 4:
+    cfg.fl = 550.0;
+    cfg.fh = 750.0;
+    cfg.tsys = 100.0;
+    cfg.antgain = 0.32;
+    break;
+  case 5:
+    cfg.fl = 1000.0;
+    cfg.fh = 1400.0;
+    cfg.tsys = 75.0;
+    cfg.antgain = 0.22;
+    break;
+  default:
+    log_error("This band does not exist at the GMRT.");
+    exit(1);
+  }
+  cfg.bw = cfg.fh - cfg.fl;
+  cfg.df = cfg.bw / (double)cfg.nf;
+  cfg.sysgain = cfg.antgain * nantennas.u.i;
+  cfg.band = band.u.i;
+  return cfg;
+}
+
+#endif
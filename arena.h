@@ -0,0 +1,124 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  Arenas, for memory that only lives as long as a block: the bursts read
+  from files for it, or synthesized again for it once they have been
+  evicted, and the scratch space to shift and verify them.
+
+  An arena is a single allocation, made and faulted in at startup, that
+  is carved up by bumping a pointer, and is reset at the start of every
+  block. Nothing carved out of it is ever freed on its own. If a block
+  needs more than the arena holds, the rest spills over to malloc, and is
+  freed on the next reset, which also grows the arena to the most that
+  any block has needed so far. A block that needs more than any before
+  it thus costs a few allocations, and the blocks after it none. Code
+  that is also used outside of blocks can be given no arena at all, and
+  then allocates from the heap, as usual.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h" // For accounting for the arena.
+
+#define ARENA_ALIGN 64 // Alignment of everything carved out of an arena.
+
+/* Struct to store an allocation that spilled over from an arena. */
+typedef struct Spill {
+  struct Spill *next; // The spill before it.
+  size_t size;        // Its size, with room for this.
+} Spill;
+
+/* Struct to store an arena. */
+typedef struct {
+  unsigned char *base;   // Memory to carve up.
+  size_t size;           // Size of it.
+  size_t used;           // Bytes carved out since the last reset.
+  size_t need;           // Most bytes needed between two resets.
+  Spill *spills;         // Allocations that spilled over since then.
+  unsigned long spilled; // Allocations that ever spilled over.
+  Memory *mem;           // Accounts to charge the arena to, if any.
+} Arena;
+
+/* Set up an arena of some size, charged to the given accounts. */
+static inline void arena_init(Arena *a, size_t size, Memory *mem) {
+  memset(a, 0, sizeof(Arena));
+  a->size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  a->base = (unsigned char *)aligned_alloc(ARENA_ALIGN, a->size);
+  a->mem = mem;
+  mem_charge(mem, MEM_ARENA, a->size);
+}
+
+/* Fault in every page of an arena, so that blocks do not pay for it. */
+static inline void arena_prefault(Arena *a) { memset(a->base, 0, a->size); }
+
+/* Carve some bytes out of an arena, or allocate them, if none. */
+static inline void *arena_alloc(Arena *a, size_t size) {
+  if (a == NULL) return malloc(size);
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  a->used += size;
+  if (a->used > a->need) a->need = a->used;
+  if (a->used <= a->size) return a->base + a->used - size;
+
+  /* Spill over, with room for a link before the allocation itself. */
+  Spill *s = (Spill *)aligned_alloc(ARENA_ALIGN, ARENA_ALIGN + size);
+  s->next = a->spills;
+  s->size = ARENA_ALIGN + size;
+  a->spills = s;
+  a->spilled++;
+  mem_charge(a->mem, MEM_ARENA, s->size);
+  return (unsigned char *)s + ARENA_ALIGN;
+}
+
+/* Carve some zeroed bytes out of an arena, or allocate them, if none. */
+static inline void *arena_calloc(Arena *a, size_t n, size_t size) {
+  if (a == NULL) return calloc(n, size);
+  void *p = arena_alloc(a, n * size);
+  memset(p, 0, n * size);
+  return p;
+}
+
+/* Let go of bytes carved out of an arena. They are only freed if there
+ * is no arena, since an arena frees everything at once, on reset.
+ */
+static inline void arena_release(Arena *a, void *p) {
+  if (a == NULL) free(p);
+}
+
+/* Reset an arena, freeing anything that spilled over, and growing it
+ * to fit, if it needs to.
+ */
+static inline void arena_reset(Arena *a) {
+  while (a->spills != NULL) {
+    Spill *s = a->spills;
+    a->spills = s->next;
+    mem_credit(a->mem, MEM_ARENA, s->size);
+    free(s);
+  }
+  if (a->need > a->size) {
+    mem_credit(a->mem, MEM_ARENA, a->size);
+    free(a->base);
+    a->size = (a->need + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    a->base = (unsigned char *)aligned_alloc(ARENA_ALIGN, a->size);
+    mem_charge(a->mem, MEM_ARENA, a->size);
+    arena_prefault(a);
+  }
+  a->used = 0;
+}
+
+/* Free an arena. */
+static inline void arena_free(Arena *a) {
+  arena_reset(a);
+  mem_credit(a->mem, MEM_ARENA, a->size);
+  free(a->base);
+  a->base = NULL;
+}
+
+#endif
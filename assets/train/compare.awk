@@ -0,0 +1,29 @@
+# Compare benchmarks of several builds, as written by arachne --bench,
+# given in order. The first build is the baseline for the speedups.
+FNR == 1 {
+  name = FILENAME
+  sub(/\/bench\.txt$/, "", name)
+  sub(/^.*\//, "", name)
+  builds[++nbuilds] = name
+}
+{
+  if (!($1 in seen)) {
+    seen[$1] = 1
+    stages[++nstages] = $1
+  }
+  secs[$1, name] = $2
+}
+END {
+  printf "%-16s", "stage"
+  for (i = 1; i <= nbuilds; ++i) printf " %18s", builds[i]
+  printf "\n"
+  for (j = 1; j <= nstages; ++j) {
+    printf "%-16s", stages[j]
+    base = secs[stages[j], builds[1]]
+    for (i = 1; i <= nbuilds; ++i) {
+      t = secs[stages[j], builds[i]]
+      printf " %9.4f s (%4.1fx)", t, (t > 0) ? base / t : 0
+    }
+    printf "\n"
+  }
+}
@@ -0,0 +1,274 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  Checkpoints of an injection campaign's progress, so that arachne can
+  pick up where it left off if it crashes, or is restarted.
+
+  The checkpoint is an append-only file of records, one for every block
+  published. Each record holds the position of the campaign's RNG, the
+  cursor of every burst (how many blocks it has been moved by, how much
+  of it has been injected, and if it is done with), and where the ring
+  buffers were. Records end with a
+  CRC32C, so a record that was only partly written when arachne died is
+  simply ignored, along with anything after it: the last whole record is
+  the checkpoint. Records are written, and synced to disk, by a thread of
+  their own, so that the main loop never waits on the disk. Once the file
+  grows too large, it is replaced by a new one with only the last record.
+  If the disk falls behind, and the queue of records has no room to grow
+  in the memory budget, the records still queued are dropped for the
+  newest one.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc.h"    // For checksums of records.
+#include "memory.h" // For accounting for the queue.
+#include "rng.h"    // For the state of the campaign's RNG.
+
+#define CKPT_MAGIC 0x41524e43    // "ARNC".
+#define CKPT_COMPACT (16L << 20) // Size past which the file is compacted.
+#define CKPT_MAXSIZE (1L << 30)  // Largest record that makes sense.
+
+/* Struct to store the start of a record. It is followed by a cursor for
+ * each burst, and then by the CRC32C of everything before it.
+ */
+typedef struct {
+  uint32_t magic;    // Always CKPT_MAGIC.
+  uint32_t size;     // Size of the record, in bytes, including its CRC.
+  uint32_t campaign; // Fingerprint of the campaign's bursts.
+  uint32_t nbursts;  // Number of bursts.
+  uint64_t serial;   // Number of the record.
+  uint32_t inblk;    // Next block to read from the input.
+  uint32_t outblk;   // Next block to publish to the output.
+  Rng rng;           // State of the campaign's RNG.
+} CkptHead;
+
+/* Struct to store the cursor of a burst. */
+typedef struct {
+  int32_t id;    // Id of the burst.
+  int32_t done;  // Whether the burst has been injected, all of it.
+  int64_t moved; // Blocks the burst has been moved by, so far.
+  int64_t next;  // Samples of it injected so far, from where it begins.
+} Cursor;
+
+/* Struct to store the writer of a checkpoint. */
+typedef struct {
+  const char *path;      // Path of the checkpoint.
+  int fd;                // The checkpoint, open for appending.
+  pthread_t writer;      // Thread that writes records out.
+  pthread_mutex_t lock;  // Guards everything below.
+  pthread_cond_t cond;   // Signalled when there are records to write.
+  unsigned char *queue;  // Records waiting to be written.
+  size_t queued;         // Bytes waiting to be written.
+  size_t room;           // Room in the queue.
+  size_t last;           // Offset of the last record in the queue.
+  bool quit;             // Whether the writer should exit.
+  long written;          // Bytes in the file.
+  unsigned long errors;  // Records that could not be written.
+  Memory *mem;           // Accounts to charge the queue to, if any.
+} Checkpoint;
+
+/* Get the size of a record for a number of bursts. */
+static inline size_t ckpt_size(uint32_t nbursts) {
+  return sizeof(CkptHead) + nbursts * sizeof(Cursor) + sizeof(uint32_t);
+}
+
+/* Read the last whole record in a checkpoint, into a buffer that the
+ * caller frees. Anything after it is cut off the file, so that new
+ * records follow on from it. Returns NULL if there is no such record,
+ * or if the file cannot be cut.
+ */
+static inline CkptHead *ckpt_load(const char *path) {
+  FILE *fp = fopen(path, "r+");
+  if (fp == NULL) return NULL;
+  CkptHead *best = NULL;
+  long good = 0;
+  for (;;) {
+    CkptHead head;
+    if (fread(&head, sizeof(head), 1, fp) != 1) break;
+    if ((head.magic != CKPT_MAGIC) || (head.size > CKPT_MAXSIZE) ||
+        (head.size != ckpt_size(head.nbursts)))
+      break;
+    unsigned char *rec = (unsigned char *)malloc(head.size);
+    memcpy(rec, &head, sizeof(head));
+    uint32_t crc;
+    if (fread(rec + sizeof(head), head.size - sizeof(head), 1, fp) != 1) {
+      free(rec);
+      break;
+    }
+    memcpy(&crc, rec + head.size - sizeof(crc), sizeof(crc));
+    if (crc32c(0, rec, head.size - sizeof(crc)) != crc) {
+      free(rec);
+      break;
+    }
+    free(best);
+    best = (CkptHead *)rec;
+    good = ftell(fp);
+  }
+  fflush(fp);
+  if (ftruncate(fileno(fp), good) < 0) {
+    free(best);
+    best = NULL;
+  }
+  fclose(fp);
+  return best;
+}
+
+/* Sync the directory that a file is in, so that renaming it sticks. */
+static inline void ckpt_syncdir(const char *path) {
+  char dir[4096];
+  snprintf(dir, sizeof(dir), "%s", path);
+  int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+  if (fd < 0) return;
+  fsync(fd);
+  close(fd);
+}
+
+/* Replace the checkpoint with one that only has its last record, and
+ * append to that from then on.
+ */
+static inline int ckpt_compact(Checkpoint *ck, const unsigned char *rec,
+                               size_t size) {
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", ck->path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) return -1;
+  if ((write(fd, rec, size) != (ssize_t)size) || (fdatasync(fd) < 0) ||
+      (rename(tmp, ck->path) < 0)) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  ckpt_syncdir(ck->path);
+  if (ck->fd >= 0) close(ck->fd);
+  ck->fd = fd;
+  ck->written = size;
+  return 0;
+}
+
+/* Write out records as they are queued, syncing once per batch. */
+static void *ckpt_write(void *arg) {
+  Checkpoint *ck = (Checkpoint *)arg;
+  unsigned char *batch = NULL;
+  size_t room = 0;
+  pthread_mutex_lock(&ck->lock);
+  for (;;) {
+    while ((ck->queued == 0) && !ck->quit)
+      pthread_cond_wait(&ck->cond, &ck->lock);
+    if (ck->queued == 0) break;
+
+    /* Take the whole queue, and leave an empty one in its place. */
+    unsigned char *full = ck->queue;
+    size_t fullroom = ck->room;
+    size_t size = ck->queued;
+    size_t last = ck->last;
+    ck->queue = batch;
+    ck->room = room;
+    ck->queued = 0;
+    batch = full;
+    room = fullroom;
+    pthread_mutex_unlock(&ck->lock);
+
+    int res = 0;
+    if ((ck->fd < 0) || (ck->written + (long)size > CKPT_COMPACT)) {
+      res = ckpt_compact(ck, batch + last, size - last);
+    } else {
+      res = (write(ck->fd, batch, size) == (ssize_t)size) ? 0 : -1;
+      if (res == 0) res = fdatasync(ck->fd);
+      if (res == 0) {
+        ck->written += size;
+      } else {
+        /* What was written may be torn, so the next batch starts over. */
+        close(ck->fd);
+        ck->fd = -1;
+      }
+    }
+
+    pthread_mutex_lock(&ck->lock);
+    if (res < 0) ck->errors++;
+  }
+  pthread_mutex_unlock(&ck->lock);
+  mem_credit(ck->mem, MEM_CKPT, room);
+  free(batch);
+  return NULL;
+}
+
+/* Open a checkpoint for appending, and start its writer. The queue is
+ * charged to the given accounts, if any. Returns 0 on success, and -1
+ * otherwise.
+ */
+static inline int ckpt_open(Checkpoint *ck, const char *path, Memory *mem) {
+  memset(ck, 0, sizeof(Checkpoint));
+  ck->path = path;
+  ck->mem = mem;
+  ck->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (ck->fd < 0) return -1;
+  struct stat st;
+  ck->written = (fstat(ck->fd, &st) == 0) ? st.st_size : 0;
+  pthread_mutex_init(&ck->lock, NULL);
+  pthread_cond_init(&ck->cond, NULL);
+  pthread_create(&ck->writer, NULL, ckpt_write, ck);
+  return 0;
+}
+
+/* Queue a record to be written. The record's CRC is filled in here. */
+static inline void ckpt_push(Checkpoint *ck, CkptHead *head,
+                             const Cursor *cursors) {
+  size_t size = ckpt_size(head->nbursts);
+  head->magic = CKPT_MAGIC;
+  head->size = size;
+  pthread_mutex_lock(&ck->lock);
+  if ((ck->queued + size > ck->room) &&
+      !mem_room(ck->mem, 2 * (ck->queued + size) - ck->room)) {
+    /* Only the last record counts, so the ones before it can go. */
+    mem_shed(ck->mem, MEM_CKPT, ck->queued / size);
+    ck->queued = 0;
+  }
+  if (ck->queued + size > ck->room) {
+    size_t room = 2 * (ck->queued + size);
+    mem_charge(ck->mem, MEM_CKPT, room - ck->room);
+    ck->room = room;
+    ck->queue = (unsigned char *)realloc(ck->queue, ck->room);
+  }
+  unsigned char *rec = ck->queue + ck->queued;
+  memcpy(rec, head, sizeof(CkptHead));
+  memcpy(rec + sizeof(CkptHead), cursors, head->nbursts * sizeof(Cursor));
+  uint32_t crc = crc32c(0, rec, size - sizeof(crc));
+  memcpy(rec + size - sizeof(crc), &crc, sizeof(crc));
+  ck->last = ck->queued;
+  ck->queued += size;
+  pthread_cond_signal(&ck->cond);
+  pthread_mutex_unlock(&ck->lock);
+}
+
+/* Write out anything still queued, and stop the writer. */
+static inline void ckpt_close(Checkpoint *ck) {
+  pthread_mutex_lock(&ck->lock);
+  ck->quit = true;
+  pthread_cond_signal(&ck->cond);
+  pthread_mutex_unlock(&ck->lock);
+  pthread_join(ck->writer, NULL);
+  if (ck->fd >= 0) close(ck->fd);
+  mem_credit(ck->mem, MEM_CKPT, ck->room);
+  free(ck->queue);
+  pthread_mutex_destroy(&ck->lock);
+  pthread_cond_destroy(&ck->cond);
+}
+
+#endif
@@ -0,0 +1,160 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  CRC32C (Castagnoli) checksums of blocks, with SSE4.2's crc32 instruction
+  where the CPU has it, and with tables where it does not. Checksums of
+  pieces of a block can be combined into the checksum of the whole, so
+  that the pieces can be checksummed in any order, by any thread, while
+  they are still in cache.
+ */
+
+#ifndef CRC_H
+#define CRC_H
+
+#include <immintrin.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define CRC32C_POLY 0x82f63b78 // Reflected.
+#define CRC32C_LANE 8192       // Bytes per lane, when running three lanes.
+
+static uint32_t crc32c_table[8][256]; // For slicing by 8.
+static uint32_t crc32c_x2n[32];       // x^(2^n) mod the polynomial.
+static uint32_t crc32c_lane[2];       // Shifts by one and two lanes.
+static bool crc32c_sse42;             // Whether the CPU has SSE4.2.
+
+/* Multiply two polynomials, modulo the polynomial. */
+static inline uint32_t crc32c_mult(uint32_t a, uint32_t b) {
+  uint32_t p = 0;
+  for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+    if (a & m) p ^= b;
+    b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+/* Get x^(8 * size) modulo the polynomial, which shifts a CRC past size
+ * bytes of zeros.
+ */
+static inline uint32_t crc32c_shift(size_t size) {
+  uint32_t p = 1u << 31;
+  for (int k = 3; size != 0; size >>= 1, ++k)
+    if (size & 1) p = crc32c_mult(crc32c_x2n[k & 31], p);
+  return p;
+}
+
+/* Build the tables, once, before main() runs, and check the CPU. */
+__attribute__((constructor)) static void crc32c_init() {
+  for (uint32_t n = 0; n < 256; ++n) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; ++k)
+      c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    crc32c_table[0][n] = c;
+  }
+  for (uint32_t n = 0; n < 256; ++n)
+    for (int k = 1; k < 8; ++k)
+      crc32c_table[k][n] = (crc32c_table[k - 1][n] >> 8) ^
+                           crc32c_table[0][crc32c_table[k - 1][n] & 0xff];
+  crc32c_x2n[0] = 1u << 30;
+  for (int k = 1; k < 32; ++k)
+    crc32c_x2n[k] = crc32c_mult(crc32c_x2n[k - 1], crc32c_x2n[k - 1]);
+  crc32c_lane[0] = crc32c_shift(CRC32C_LANE);
+  crc32c_lane[1] = crc32c_shift(2 * CRC32C_LANE);
+  __builtin_cpu_init();
+  crc32c_sse42 = __builtin_cpu_supports("sse4.2");
+}
+
+/* Eight bytes at a time, with tables. */
+static inline uint32_t crc32c_sw(uint32_t crc, const unsigned char *p,
+                                 size_t size) {
+  uint32_t c = ~crc;
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+    x ^= c;
+    c = crc32c_table[7][x & 0xff] ^ crc32c_table[6][(x >> 8) & 0xff] ^
+        crc32c_table[5][(x >> 16) & 0xff] ^ crc32c_table[4][(x >> 24) & 0xff] ^
+        crc32c_table[3][(x >> 32) & 0xff] ^ crc32c_table[2][(x >> 40) & 0xff] ^
+        crc32c_table[1][(x >> 48) & 0xff] ^ crc32c_table[0][x >> 56];
+  }
+  for (; size > 0; ++p, --size)
+    c = (c >> 8) ^ crc32c_table[0][(c ^ *p) & 0xff];
+  return ~c;
+}
+
+/* Eight bytes at a time, with SSE4.2, in three lanes at once. The crc32
+ * instruction takes three cycles, but a new one can start every cycle,
+ * so three independent lanes keep it busy. The lanes are then shifted
+ * into place, and combined.
+ */
+__attribute__((target("sse4.2"))) static inline uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t size) {
+  uint64_t c0 = ~crc;
+  for (; size >= 3 * CRC32C_LANE; p += 3 * CRC32C_LANE,
+                                  size -= 3 * CRC32C_LANE) {
+    uint64_t c1 = 0;
+    uint64_t c2 = 0;
+    for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+      uint64_t x0, x1, x2;
+      memcpy(&x0, p + i, 8);
+      memcpy(&x1, p + CRC32C_LANE + i, 8);
+      memcpy(&x2, p + 2 * CRC32C_LANE + i, 8);
+      c0 = _mm_crc32_u64(c0, x0);
+      c1 = _mm_crc32_u64(c1, x1);
+      c2 = _mm_crc32_u64(c2, x2);
+    }
+    c0 = crc32c_mult(crc32c_lane[1], (uint32_t)c0) ^
+         crc32c_mult(crc32c_lane[0], (uint32_t)c1) ^ (uint32_t)c2;
+  }
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+    c0 = _mm_crc32_u64(c0, x);
+  }
+  for (; size > 0; ++p, --size) c0 = _mm_crc32_u8((uint32_t)c0, *p);
+  return ~(uint32_t)c0;
+}
+
+/* Update a CRC with some data. Start from a CRC of 0. */
+static inline uint32_t crc32c(uint32_t crc, const void *data, size_t size) {
+  if (crc32c_sse42) return crc32c_hw(crc, (const unsigned char *)data, size);
+  return crc32c_sw(crc, (const unsigned char *)data, size);
+}
+
+/* Combine the CRCs of two pieces of data into the CRC of both, one after
+ * the other, given the size of the second.
+ */
+static inline uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2,
+                                      size_t size2) {
+  return crc32c_mult(crc32c_shift(size2), crc1) ^ crc2;
+}
+
+/* Update the CRC of some data for a change to a piece of it, given the
+ * CRCs of the piece before and after the change, and the number of bytes
+ * that follow the piece. CRCs are linear, so the rest need not be read.
+ */
+static inline uint32_t crc32c_patch(uint32_t crc, uint32_t before,
+                                    uint32_t after, size_t tail) {
+  return crc ^ crc32c_mult(crc32c_shift(tail), before ^ after);
+}
+
+/* Copy data, and get its CRC, a piece at a time, so that each piece is
+ * checksummed while it is still in cache.
+ */
+static inline uint32_t crc32c_copy(void *dst, const void *src, size_t size) {
+  uint32_t crc = 0;
+  for (size_t off = 0; off < size; off += 3 * CRC32C_LANE) {
+    size_t len = (size - off < 3 * CRC32C_LANE) ? size - off : 3 * CRC32C_LANE;
+    memcpy((unsigned char *)dst + off, (const unsigned char *)src + off, len);
+    crc = crc32c(crc, (const unsigned char *)dst + off, len);
+  }
+  return crc;
+}
+
+#endif
@@ -0,0 +1,356 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  A timeline index of the blocks in a dump, written alongside it (as
+  "<debugfile>.idx"), and a reader for it. The index has a header, and
+  then one entry of a fixed size for every block in the dump, in the
+  order they were dumped: where the block is in the dump, its number in
+  both ring buffers, when it was stamped, its CRC32C, whether blocks
+  before it were skipped, and which bursts were injected into it.
+
+  Since entries have a fixed size and block numbers and times only go
+  up, the reader finds a block, or a time, with a binary search on the
+  index, mapped into memory. Bursts are found with a binary search on a
+  table sorted by burst, built once when the index is opened. Only the
+  blocks that are asked for are then mapped from the dump. Entries are
+  flushed as they are written, so a dump can be read while arachne is
+  still writing to it.
+
+  Dumps may also be packed, four 2-bit samples to a byte, which makes
+  them four times smaller, and four times faster to read back. The first
+  sample is in the lowest bits.
+ */
+
+#ifndef DUMPIDX_H
+#define DUMPIDX_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DUMPIDX_MAGIC 0x41524e49 // "ARNI".
+#define DUMPIDX_VERSION 1
+#define DUMPIDX_MAXIDS 8 // Bursts listed per block; the rest are counted.
+
+/* Struct to store the header of an index. */
+typedef struct {
+  uint32_t magic;   // Always DUMPIDX_MAGIC.
+  uint32_t version; // Always DUMPIDX_VERSION.
+  uint32_t entsize; // Size of an entry, in bytes.
+  uint32_t nchan;   // Number of channels.
+  uint32_t packing; // Samples per byte in the dump: 1, or 4 if packed.
+  uint32_t flipped; // Whether channels go from the highest frequency down.
+  uint64_t blksize; // Size of a block in the dump, in bytes.
+  double tsamp;     // Sampling time, in s.
+  double fl;        // Lowest frequency, in MHz.
+  double fh;        // Highest frequency, in MHz.
+} DumpHead;
+
+/* Struct to store the entry of a block in an index. */
+typedef struct {
+  uint32_t blkno;              // Number of the block, in the output.
+  uint32_t inblk;              // Number of the block, in the input.
+  int64_t offset;              // Where the block starts in the dump.
+  double gps;                  // GPS time it was stamped with, in s.
+  double datatime;             // Time since the start of the scan, in s.
+  uint32_t flags;              // Flags it was published with.
+  uint32_t crc;                // CRC32C of the block.
+  uint32_t slot;               // Slot of the output it was published in.
+  uint32_t nbursts;            // Number of bursts injected into it.
+  int32_t ids[DUMPIDX_MAXIDS]; // Ids of the first of those bursts.
+} DumpEntry;
+
+/* Struct to store a block that a burst was injected into. */
+typedef struct {
+  int32_t id;     // Id of the burst.
+  uint32_t entry; // Entry of the block.
+} DumpHit;
+
+/* Struct to store an index, open for reading, and its dump. */
+typedef struct {
+  void *map;            // The index, mapped into memory.
+  size_t mapsize;       // Size of the mapping.
+  const DumpHead *head; // Header of the index.
+  const DumpEntry *ent; // Entries of the index.
+  long count;           // Number of whole entries.
+  DumpHit *hits;        // Blocks with bursts, sorted by burst.
+  long nhits;           // Number of them.
+  int fd;               // The dump.
+  long dumpsize;        // Size of the dump, in bytes.
+} DumpIndex;
+
+/* Struct to store blocks of a dump, mapped into memory. */
+typedef struct {
+  void *base;          // Start of the mapping, aligned to a page.
+  size_t size;         // Size of the mapping.
+  unsigned char *data; // First byte of the first block.
+  size_t len;          // Bytes of whole blocks that were mapped.
+} DumpView;
+
+/* Get the path of the index of a dump, into a buffer of some size. */
+static inline void dumpidx_path(const char *dump, char *path, size_t size) {
+  snprintf(path, size, "%s.idx", dump);
+}
+
+/* Create the index of a dump, and write its header, whose magic, version
+ * and entry size are filled in here. Returns NULL if it could not be
+ * created.
+ */
+static inline FILE *dumpidx_create(const char *dump, DumpHead *head) {
+  char path[4096];
+  dumpidx_path(dump, path, sizeof(path));
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) return NULL;
+  head->magic = DUMPIDX_MAGIC;
+  head->version = DUMPIDX_VERSION;
+  head->entsize = sizeof(DumpEntry);
+  fwrite(head, sizeof(DumpHead), 1, fp);
+  fflush(fp);
+  return fp;
+}
+
+/* Open the index of a dump to add to it, as when resuming, if its header
+ * matches (filled in as for dumpidx_create). Entries that were cut short,
+ * and those of blocks numbered from one on, which are to be published
+ * again, are cut off. The dump should be cut to the size returned, which
+ * drops their blocks, along with any block that was cut short. Returns
+ * NULL if there is no such index, or if it is of another kind of dump.
+ */
+static inline FILE *dumpidx_resume(const char *dump, DumpHead *head,
+                                   uint32_t from, long *size) {
+  char path[4096];
+  dumpidx_path(dump, path, sizeof(path));
+  FILE *fp = fopen(path, "r+");
+  if (fp == NULL) return NULL;
+  head->magic = DUMPIDX_MAGIC;
+  head->version = DUMPIDX_VERSION;
+  head->entsize = sizeof(DumpEntry);
+  DumpHead old;
+  if ((fread(&old, sizeof(DumpHead), 1, fp) != 1) ||
+      (memcmp(&old, head, sizeof(DumpHead)) != 0)) {
+    fclose(fp);
+    return NULL;
+  }
+  long keep = sizeof(DumpHead);
+  DumpEntry e;
+  *size = 0;
+  while (fread(&e, sizeof(DumpEntry), 1, fp) == 1) {
+    if (e.blkno >= from) {
+      *size = e.offset;
+      break;
+    }
+    keep += sizeof(DumpEntry);
+    *size = e.offset + (long)head->blksize;
+  }
+  fflush(fp);
+  if ((ftruncate(fileno(fp), keep) < 0) || (fseek(fp, keep, SEEK_SET) < 0)) {
+    fclose(fp);
+    return NULL;
+  }
+  return fp;
+}
+
+/* Add the entry of a block, once the block is in the dump. */
+static inline void dumpidx_append(FILE *fp, const DumpEntry *e) {
+  fwrite(e, sizeof(DumpEntry), 1, fp);
+  fflush(fp);
+}
+
+/* Pack 2-bit samples, four to a byte, 8 samples at a time. The size is
+ * that of the samples, and must be a multiple of 8.
+ */
+static inline void dumpidx_pack(unsigned char *dst, const unsigned char *src,
+                                long size) {
+  for (long i = 0; i < size; i += 8) {
+    uint64_t x;
+    memcpy(&x, src + i, 8);
+    x = (x | (x >> 6)) & 0x000f000f000f000fULL;
+    x = (x | (x >> 12)) & 0x000000ff000000ffULL;
+    uint16_t y = (uint16_t)(x | (x >> 24));
+    memcpy(dst + i / 4, &y, 2);
+  }
+}
+
+/* Unpack 2-bit samples, 8 at a time. The size is that of the samples,
+ * and must be a multiple of 8.
+ */
+static inline void dumpidx_unpack(unsigned char *dst, const unsigned char *src,
+                                  long size) {
+  for (long i = 0; i < size; i += 8) {
+    uint16_t y;
+    memcpy(&y, src + i / 4, 2);
+    uint64_t x = y;
+    x = (x | (x << 24)) & 0x000000ff000000ffULL;
+    x = (x | (x << 12)) & 0x000f000f000f000fULL;
+    x = (x | (x << 6)) & 0x0303030303030303ULL;
+    memcpy(dst + i, &x, 8);
+  }
+}
+
+/* Sort hits by burst, and then by block. */
+static int dumpidx_byhit(const void *a, const void *b) {
+  const DumpHit *x = (const DumpHit *)a;
+  const DumpHit *y = (const DumpHit *)b;
+  if (x->id != y->id) return (x->id < y->id) ? -1 : 1;
+  return (x->entry > y->entry) - (x->entry < y->entry);
+}
+
+/* Open a dump and its index. Returns 0 on success, and -1 if either
+ * cannot be opened, or the index is not one.
+ */
+static inline int dumpidx_open(DumpIndex *idx, const char *dump) {
+  memset(idx, 0, sizeof(DumpIndex));
+  idx->fd = -1;
+  char path[4096];
+  dumpidx_path(dump, path, sizeof(path));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  struct stat st;
+  if ((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(DumpHead))) {
+    close(fd);
+    return -1;
+  }
+  idx->mapsize = st.st_size;
+  idx->map = mmap(NULL, idx->mapsize, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (idx->map == MAP_FAILED) {
+    idx->map = NULL;
+    return -1;
+  }
+  idx->head = (const DumpHead *)idx->map;
+  if ((idx->head->magic != DUMPIDX_MAGIC) ||
+      (idx->head->version != DUMPIDX_VERSION) ||
+      (idx->head->entsize != sizeof(DumpEntry)) ||
+      (idx->head->blksize == 0) || (idx->head->packing == 0)) {
+    munmap(idx->map, idx->mapsize);
+    idx->map = NULL;
+    return -1;
+  }
+  idx->ent = (const DumpEntry *)(idx->head + 1);
+  idx->count = (idx->mapsize - sizeof(DumpHead)) / sizeof(DumpEntry);
+
+  idx->fd = open(dump, O_RDONLY | O_CLOEXEC);
+  if ((idx->fd < 0) || (fstat(idx->fd, &st) < 0)) {
+    if (idx->fd >= 0) close(idx->fd);
+    munmap(idx->map, idx->mapsize);
+    idx->map = NULL;
+    idx->fd = -1;
+    return -1;
+  }
+  idx->dumpsize = st.st_size;
+
+  long nhits = 0;
+  for (long i = 0; i < idx->count; ++i)
+    nhits += (idx->ent[i].nbursts < DUMPIDX_MAXIDS) ? idx->ent[i].nbursts
+                                                    : DUMPIDX_MAXIDS;
+  idx->hits = (DumpHit *)malloc((nhits + 1) * sizeof(DumpHit));
+  for (long i = 0; i < idx->count; ++i)
+    for (uint32_t j = 0; (j < idx->ent[i].nbursts) && (j < DUMPIDX_MAXIDS);
+         ++j)
+      idx->hits[idx->nhits++] = (DumpHit){idx->ent[i].ids[j], (uint32_t)i};
+  qsort(idx->hits, idx->nhits, sizeof(DumpHit), dumpidx_byhit);
+  return 0;
+}
+
+/* Close a dump and its index. */
+static inline void dumpidx_close(DumpIndex *idx) {
+  if (idx->map) munmap(idx->map, idx->mapsize);
+  if (idx->fd >= 0) close(idx->fd);
+  free(idx->hits);
+  memset(idx, 0, sizeof(DumpIndex));
+  idx->fd = -1;
+}
+
+/* Find the entry of a block, by its number in the output. Returns -1 if
+ * it is not in the dump.
+ */
+static inline long dumpidx_block(const DumpIndex *idx, uint32_t blkno) {
+  long lo = 0;
+  long hi = idx->count;
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (idx->ent[mid].blkno < blkno)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return ((lo < idx->count) && (idx->ent[lo].blkno == blkno)) ? lo : -1;
+}
+
+/* Find the entry of the block that a GPS time falls in: the last one
+ * stamped at or before it. Returns -1 if the time is before the dump.
+ */
+static inline long dumpidx_time(const DumpIndex *idx, double gps) {
+  long lo = 0;
+  long hi = idx->count;
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (idx->ent[mid].gps <= gps)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo - 1;
+}
+
+/* Find the entries of the blocks that a burst was injected into. The
+ * first is put in first, and the number of them is returned.
+ */
+static inline long dumpidx_burst(const DumpIndex *idx, int32_t id,
+                                 long *first) {
+  long lo = 0;
+  long hi = idx->nhits;
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (idx->hits[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  long n = 0;
+  while ((lo + n < idx->nhits) && (idx->hits[lo + n].id == id)) n++;
+  *first = (n > 0) ? (long)idx->hits[lo].entry : -1;
+  return n;
+}
+
+/* Map some blocks of the dump, starting from an entry, into memory. The
+ * blocks are contiguous, since the dump has every block that was
+ * published. Returns 0 on success, and -1 if they are not in the dump.
+ */
+static inline int dumpidx_map(const DumpIndex *idx, long entry, long nblocks,
+                              DumpView *view) {
+  memset(view, 0, sizeof(DumpView));
+  if ((entry < 0) || (nblocks <= 0) || (entry + nblocks > idx->count))
+    return -1;
+  long beg = idx->ent[entry].offset;
+  long len = nblocks * (long)idx->head->blksize;
+  if (beg + len > idx->dumpsize) return -1;
+  long page = sysconf(_SC_PAGESIZE);
+  long start = beg - beg % page;
+  view->size = len + (beg - start);
+  view->base = mmap(NULL, view->size, PROT_READ, MAP_SHARED, idx->fd, start);
+  if (view->base == MAP_FAILED) {
+    memset(view, 0, sizeof(DumpView));
+    return -1;
+  }
+  view->data = (unsigned char *)view->base + (beg - start);
+  view->len = len;
+  return 0;
+}
+
+/* Unmap blocks of a dump. */
+static inline void dumpidx_unmap(DumpView *view) {
+  if (view->base) munmap(view->base, view->size);
+  memset(view, 0, sizeof(DumpView));
+}
+
+#endif
@@ -0,0 +1,290 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  Streaming the ring buffer arachne writes to over TCP, to consumers on
+  other machines, and rebuilding it there.
+ */
+
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "crc.h"  // For checksums of blocks.
+#include "ring.h" // For the layout of the ring buffers.
+
+/* THE WIRE
+ * ========
+ *
+ * Each block is sent as a frame, followed by the block's data, and then
+ * a trailer. The frame holds the block's number and flags, a snapshot of
+ * the ring buffer's header, and the slot's sequence number from before
+ * the data was sent. The data is sent straight out of the ring buffer,
+ * with MSG_ZEROCOPY, so the kernel may read it a while after it has been
+ * handed over. The trailer holds the slot's sequence number from after
+ * the kernel was done with it. If the two differ, the slot was rewritten
+ * as it was sent, and the receiver throws the block away, just as a
+ * local consumer would. The receiver also checks the block against the
+ * CRC in the frame as it comes in, to catch anything that went wrong on
+ * the way. Everything is in the sender's byte order.
+ */
+#define EXPORT_MAGIC 0x41524e58 // "ARNX".
+#define EXPORT_PORT 5033
+#define EXPORT_CHUNK (1L << 20)
+
+/* Struct for the frame that every block is sent with. */
+typedef struct {
+  uint32_t magic;  // Always EXPORT_MAGIC.
+  uint32_t blkno;  // Number of the block.
+  uint32_t flags;  // Flags for the block.
+  uint32_t seq;    // Sequence number of the slot, before sending.
+  uint32_t crc;    // CRC32C of the block.
+  uint32_t size;   // Size of the block's data, in bytes.
+  double comptime; // The data's comptime for the block's slot.
+  double datatime; // The data's datatime for the block's slot.
+  Header hdr;      // Snapshot of the ring buffer's header.
+} ExportFrame;
+
+/* Struct for the trailer that every block is sent with. */
+typedef struct {
+  uint32_t magic; // Always EXPORT_MAGIC.
+  uint32_t seq;   // Sequence number of the slot, after sending.
+} ExportTrailer;
+
+/* Listen for subscribers on a TCP address and port. Returns the listening
+ * socket, or -1 on failure.
+ */
+static inline int export_listen(const char *addr, int port) {
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(addr, NULL, &hints, &res) != 0) return -1;
+  sa.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+  freeaddrinfo(res);
+
+  int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) return -1;
+  int on = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if ((bind(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) ||
+      (listen(sock, 16) < 0)) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/* Connect to an exporter. Returns the socket, or -1 on failure. */
+static inline int export_connect(const char *host, int port) {
+  char service[16];
+  snprintf(service, sizeof(service), "%d", port);
+  struct addrinfo hints, *res;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, service, &hints, &res) != 0) return -1;
+
+  int sock = -1;
+  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+    sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, 0);
+    if (sock < 0) continue;
+    if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) break;
+    close(sock);
+    sock = -1;
+  }
+  freeaddrinfo(res);
+  return sock;
+}
+
+/* Ask for zerocopy sends on a socket. Returns whether it can do them. */
+static inline bool export_zerocopy(int sock) {
+  int on = 1;
+  return setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+}
+
+/* Send all of a buffer. With zerocopy, the kernel keeps references to
+ * the buffer's pages instead of copying them, and each call that it does
+ * this for is counted in issued, so that export_reap() can tell when it
+ * is done with them. Where it runs out of room to do so, the data is
+ * copied as usual. Returns 0 on success, and -1 otherwise.
+ */
+static inline int export_write(int sock, const void *data, size_t size,
+                               bool zerocopy, uint32_t *issued) {
+  const unsigned char *ptr = (const unsigned char *)data;
+  while (size > 0) {
+    size_t len = (size < EXPORT_CHUNK) ? size : EXPORT_CHUNK;
+    int flags = MSG_NOSIGNAL | ((zerocopy) ? MSG_ZEROCOPY : 0);
+    ssize_t n = send(sock, ptr, len, flags);
+    if ((n < 0) && (errno == ENOBUFS) && zerocopy)
+      n = send(sock, ptr, len, MSG_NOSIGNAL);
+    else if ((n >= 0) && zerocopy)
+      ++*issued;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    ptr += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/* Wait until the kernel is done with every buffer sent with zerocopy, as
+ * it reports on the socket's error queue. Returns 0 once it is, and -1 if
+ * the connection is lost.
+ */
+static inline int export_reap(int sock, uint32_t issued, uint32_t *done) {
+  while ((int32_t)(issued - *done) > 0) {
+    struct pollfd pfd = {sock, 0, 0};
+    if (poll(&pfd, 1, 1000) < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (pfd.revents & (POLLHUP | POLLNVAL)) return -1;
+    if (!(pfd.revents & POLLERR)) continue;
+
+    char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      if ((errno == EAGAIN) || (errno == EINTR)) continue;
+      return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      struct sock_extended_err *err =
+          (struct sock_extended_err *)CMSG_DATA(cmsg);
+      if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+      if ((int32_t)(err->ee_data + 1 - *done) > 0) *done = err->ee_data + 1;
+    }
+  }
+  return 0;
+}
+
+/* Send a block from the ring buffer, with any extra flags. The slot has
+ * to hold the block as sending begins, or it is not sent at all. Returns
+ * RING_OK if the block was sent intact, RING_OVERRUN if its slot was (or
+ * was being) rewritten, and -1 if the connection is lost.
+ */
+static inline int export_send(int sock, RingHeader *hdr, Buffer *buf,
+                              unsigned int blk, unsigned int flags,
+                              bool zerocopy, uint32_t *issued,
+                              uint32_t *done) {
+  int slot = blk % MAXBLKS;
+  ExportFrame frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.magic = EXPORT_MAGIC;
+  frame.seq = __atomic_load_n(&hdr->seq[slot], __ATOMIC_ACQUIRE);
+  if ((frame.seq & 1) ||
+      (__atomic_load_n(&hdr->blkno[slot], __ATOMIC_RELAXED) != blk))
+    return RING_OVERRUN;
+  frame.blkno = blk;
+  frame.flags = __atomic_load_n(&hdr->flags[slot], __ATOMIC_RELAXED) | flags;
+  frame.crc = __atomic_load_n(&hdr->crc[slot], __ATOMIC_RELAXED);
+  frame.size = BLKSIZE;
+  frame.comptime = buf->comptime[slot];
+  frame.datatime = buf->datatime[slot];
+  frame.hdr = hdr->hdr;
+
+  ExportTrailer trailer = {EXPORT_MAGIC, 0};
+  if ((export_write(sock, &frame, sizeof(frame), false, issued) < 0) ||
+      (export_write(sock, buf->data + (long)BLKSIZE * (long)slot, BLKSIZE,
+                    zerocopy, issued) < 0) ||
+      (export_reap(sock, *issued, done) < 0))
+    return -1;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  trailer.seq = __atomic_load_n(&hdr->seq[slot], __ATOMIC_RELAXED);
+  if (export_write(sock, &trailer, sizeof(trailer), false, issued) < 0)
+    return -1;
+  return (trailer.seq == frame.seq) ? RING_OK : RING_OVERRUN;
+}
+
+/* Receive all of a buffer. Returns 0 on success, and -1 otherwise. */
+static inline int export_read(int sock, void *data, size_t size) {
+  unsigned char *ptr = (unsigned char *)data;
+  while (size > 0) {
+    ssize_t n = recv(sock, ptr, size, MSG_WAITALL);
+    if (n == 0) return -1;
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    ptr += n;
+    size -= n;
+  }
+  return 0;
+}
+
+/* Receive a block into a local ring buffer, into the same slot as in the
+ * sender's, and publish it the same way. Returns RING_OK if the block was
+ * published, RING_OVERRUN if it arrived torn, RING_CORRUPT if it did not
+ * match its CRC (either way, it is thrown away), and -1 if the connection
+ * is lost or the stream makes no sense.
+ */
+static inline int export_recv(int sock, RingHeader *hdr, Buffer *buf,
+                              unsigned int *blk) {
+  ExportFrame frame;
+  ExportTrailer trailer;
+  if ((export_read(sock, &frame, sizeof(frame)) < 0) ||
+      (frame.magic != EXPORT_MAGIC) || (frame.size != BLKSIZE))
+    return -1;
+
+  /* Check the block a chunk at a time, as each chunk comes in. */
+  int slot = frame.blkno % MAXBLKS;
+  unsigned char *data = buf->data + (long)BLKSIZE * (long)slot;
+  uint32_t crc = 0;
+  *blk = frame.blkno;
+  ring_write_begin(hdr, slot);
+  for (long off = 0; off < BLKSIZE; off += EXPORT_CHUNK) {
+    long len = (off + EXPORT_CHUNK > BLKSIZE) ? BLKSIZE - off : EXPORT_CHUNK;
+    if (export_read(sock, data + off, len) < 0) {
+      ring_write_abort(hdr, slot);
+      return -1;
+    }
+    crc = crc32c(crc, data + off, len);
+  }
+  if ((export_read(sock, &trailer, sizeof(trailer)) < 0) ||
+      (trailer.magic != EXPORT_MAGIC)) {
+    ring_write_abort(hdr, slot);
+    return -1;
+  }
+  if ((trailer.seq != frame.seq) || (crc != frame.crc)) {
+    ring_write_abort(hdr, slot);
+    return (trailer.seq != frame.seq) ? RING_OVERRUN : RING_CORRUPT;
+  }
+
+  hdr->hdr.active = frame.hdr.active;
+  hdr->hdr.status = frame.hdr.status;
+  hdr->hdr.comptime = frame.hdr.comptime;
+  hdr->hdr.datatime = frame.hdr.datatime;
+  hdr->hdr.reftime = frame.hdr.reftime;
+  hdr->hdr.timestamp[slot] = frame.hdr.timestamp[slot];
+  hdr->hdr.timestamp_gps[slot] = frame.hdr.timestamp_gps[slot];
+  hdr->hdr.blk_nano[slot] = frame.hdr.blk_nano[slot];
+  buf->comptime[slot] = frame.comptime;
+  buf->datatime[slot] = frame.datatime;
+  ring_write_end(hdr, buf, slot, frame.blkno, frame.flags, frame.crc);
+  return RING_OK;
+}
+
+#endif
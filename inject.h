@@ -0,0 +1,130 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  Injection of a signal into a single 2-bit sample.
+ */
+
+#ifndef INJECT_H
+#define INJECT_H
+
+#include <stdint.h>
+
+#include "arachne.h"
+
+/* Get the output level for a sample, given its input level and the
+ * signal to inject (in units of the noise RMS).
+ *
+ * The 2-bit levels 0, 1, 2 and 3 correspond to noise in the intervals
+ * (-inf, -1), [-1, 0), [0, 1) and [1, inf), with a threshold (lvl) of
+ * one RMS. Given the input level, the noise is somewhere within its
+ * interval; adding the signal moves it up, possibly into a higher level.
+ * The probabilities of landing in each level (plvl1, plvl2 and plvl3,
+ * cumulative, from the highest level down) are compared against the
+ * uniform deviate pval to pick the output level.
+ */
+static inline int transition(int in, double signal, double pval) {
+  int out = in;
+  double lvl = 1;
+  double plvl1, plvl2, plvl3;
+
+  if (in == 3)
+    out = 3;
+  else if (in == 2) {
+    plvl1 = (prob(max(0, lvl - signal)) - 0.5) / (prob(lvl) - 0.5);
+    if (pval < plvl1)
+      out = 2;
+    else
+      out = 3;
+  } else if (in == 1) {
+    plvl1 = (0.5 - prob(clip(lvl - signal, -lvl, 0))) / (0.5 - prob(-lvl));
+    plvl2 = plvl1 +
+            (prob(clip(lvl - signal, -lvl, 0)) - prob(max(-signal, -lvl))) /
+                (0.5 - prob(-lvl));
+    if (pval < plvl1)
+      out = 3;
+    else if (pval < plvl2)
+      out = 2;
+    else
+      out = 1;
+  } else if (in == 0) {
+    plvl1 = (prob(-lvl) - prob(min(-signal + lvl, -lvl))) / prob(-lvl);
+    plvl2 = plvl1 +
+            (prob(min(-signal + lvl, -lvl)) - prob(min(-signal, -lvl))) /
+                prob(-lvl);
+    plvl3 = plvl2 +
+            (prob(min(-signal, -lvl)) - prob(-lvl - signal)) / prob(-lvl);
+    if (pval < plvl1)
+      out = 3;
+    else if (pval < plvl2)
+      out = 2;
+    else if (pval < plvl3)
+      out = 1;
+    else
+      out = 0;
+  }
+  return out;
+}
+
+/* TABLES
+ * ======
+ *
+ * transition() evaluates erfc() up to six times for every sample, which
+ * is most of what injecting costs. As a fast path, the distribution of
+ * the output levels for each input level is tabulated on a grid of
+ * signals, as cumulative probabilities scaled to 32 bits, so that a
+ * sample only needs a lookup and a random 32-bit integer. Signals are
+ * interpolated linearly between grid points, which are 1/256 of the RMS
+ * apart; above the grid, the last grid point is used. Like transition(),
+ * it never lowers a level, so negative signals count as zero.
+ */
+#define TABLE_NSIG 4097
+#define TABLE_SMAX 16.0
+
+/* Struct to store the table of transitions. */
+typedef struct {
+  double cut[TABLE_NSIG][4][3]; // P(out <= k | in, signal), scaled to 2^32.
+} Table;
+
+/* Build the table of transitions. */
+static inline void table_build(Table *t) {
+  static const double edges[5] = {-INFINITY, -1.0, 0.0, 1.0, INFINITY};
+  for (int i = 0; i < TABLE_NSIG; ++i) {
+    double signal = i * TABLE_SMAX / (TABLE_NSIG - 1);
+    for (int in = 0; in < 4; ++in) {
+      double norm = prob(edges[in + 1]) - prob(edges[in]);
+      double acc = 0.0;
+      for (int k = 0; k < 3; ++k) {
+        double lo = max(edges[in], edges[k] - signal);
+        double hi = min(edges[in + 1], edges[k + 1] - signal);
+        if (hi > lo) acc += (prob(hi) - prob(lo)) / norm;
+        t->cut[i][in][k] = min(acc, 1.0) * 4294967296.0;
+      }
+    }
+  }
+}
+
+/* Get the output level for a sample from the table, given its input
+ * level, the signal to inject, and a random 32-bit integer.
+ */
+static inline int table_transition(const Table *t, int in, double signal,
+                                   uint32_t bits) {
+  double x = max(signal, 0.0) * ((TABLE_NSIG - 1) / TABLE_SMAX);
+  int i = (int)x;
+  if (i >= TABLE_NSIG - 1) {
+    i = TABLE_NSIG - 2;
+    x = TABLE_NSIG - 1;
+  }
+  double f = x - i;
+  const double *lo = t->cut[i][in];
+  const double *hi = t->cut[i + 1][in];
+  double u = (double)bits;
+  return (u >= lo[0] + f * (hi[0] - lo[0])) +
+         (u >= lo[1] + f * (hi[1] - lo[1])) +
+         (u >= lo[2] + f * (hi[2] - lo[2]));
+}
+
+#endif
@@ -0,0 +1,98 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  Accounts of the memory that arachne holds, one for each subsystem, and
+  a budget for all of them together, so that arachne never pushes the
+  machine it shares with the telescope's producer into swap.
+
+  Subsystems charge their accounts as they allocate, and credit them as
+  they free. Memory that arachne cannot do without (the ring buffer, the
+  block it injects into, its tables) is charged as it is. Memory that it
+  can do without is only held on to if there is room for it in the
+  budget; if there is not, load is shed instead, in the order of the
+  accounts below: bursts further ahead are evicted, to be synthesized
+  again when they come up, bursts that still do not fit are deferred,
+  and then the checkpoint's queue is cut down to its last record.
+  Accounts are updated atomically, so that any thread can charge them.
+  A synthesized burst's size is only known once it has been synthesized,
+  and checks for room are not atomic with the charges that follow them,
+  so the budget may be overshot, briefly, by a burst or two.
+ */
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Subsystems whose memory is accounted for, in the order they shed. */
+enum {
+  MEM_BURSTS, // Bursts held in memory, synthesized or read from files.
+  MEM_CKPT,   // Records queued for the checkpoint.
+  MEM_DUMP,   // Blocks being packed for the dump.
+  MEM_ARENA,  // Memory for each block, reset between blocks.
+  MEM_TABLES, // Tables of transitions, delays and kernels.
+  MEM_BLOCKS, // Blocks being injected into.
+  MEM_RING,   // The output ring buffer.
+  MEM_KINDS,
+};
+
+/* Get the name of a subsystem's account. */
+static inline const char *mem_name(int kind) {
+  static const char *names[MEM_KINDS] = {
+      "bursts", "ckpt", "dump", "arena", "tables", "blocks", "ring"};
+  return names[kind];
+}
+
+/* Struct to store the accounts. */
+typedef struct {
+  long used[MEM_KINDS];          // Bytes held by each subsystem.
+  unsigned long shed[MEM_KINDS]; // Loads shed by each subsystem.
+  long total;                    // Bytes held by all of them.
+  long peak;                     // Most bytes ever held.
+  long budget;                   // Most bytes to hold, or 0 for no limit.
+} Memory;
+
+/* Charge bytes to a subsystem's account, or credit them, if negative. */
+static inline void mem_charge(Memory *m, int kind, long bytes) {
+  if (m == NULL) return;
+  __atomic_add_fetch(&m->used[kind], bytes, __ATOMIC_RELAXED);
+  long total = __atomic_add_fetch(&m->total, bytes, __ATOMIC_RELAXED);
+  long peak = __atomic_load_n(&m->peak, __ATOMIC_RELAXED);
+  while ((total > peak) &&
+         !__atomic_compare_exchange_n(&m->peak, &peak, total, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* Credit bytes back to a subsystem's account. */
+static inline void mem_credit(Memory *m, int kind, long bytes) {
+  mem_charge(m, kind, -bytes);
+}
+
+/* Check whether there is room in the budget for some bytes more. */
+static inline bool mem_room(Memory *m, long bytes) {
+  if ((m == NULL) || (m->budget <= 0)) return true;
+  return __atomic_load_n(&m->total, __ATOMIC_RELAXED) + bytes <= m->budget;
+}
+
+/* Get the bytes held that cannot be shed: all but the bursts and the
+ * checkpoint's queue.
+ */
+static inline long mem_fixed(Memory *m) {
+  long fixed = 0;
+  for (int k = MEM_CKPT + 1; k < MEM_KINDS; ++k)
+    fixed += __atomic_load_n(&m->used[k], __ATOMIC_RELAXED);
+  return fixed;
+}
+
+/* Count loads shed by a subsystem, for lack of room. */
+static inline void mem_shed(Memory *m, int kind, unsigned long n) {
+  if (m != NULL) __atomic_add_fetch(&m->shed[kind], n, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,147 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  Latency probes: markers that arachne writes into some of the blocks it
+  publishes, and that consumers find again, to measure how long it takes
+  from a block arriving in the telescope's ring buffer to a consumer
+  acting on it, across every process in between.
+
+  A probe is written into a few reserved channels (ones that consumers
+  already ignore, such as those at the edge of the band), one bit per
+  spectrum, with every reserved channel of a spectrum set to the highest
+  2-bit sample for a one, and to zero for a zero. It starts with a
+  13-bit Barker code, to find it by, followed by a 16-bit sequence
+  number, the time the block arrived (in us since the epoch, by the
+  clock of the machine that stamped it), and a CRC-8 of both. Noise is
+  all but certain to break the pattern within a few spectra, so finding
+  a probe is cheap, and finding a false one is all but impossible.
+
+  A consumer reads the arrival time off the probe, and subtracts it from
+  the time it acts on the block. Across machines, this is only as good
+  as the agreement between their clocks.
+ */
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define PROBE_SYNC 0x1f35 // 13-bit Barker code, 1111100110101.
+#define PROBE_NSYNC 13    // Bits in it.
+#define PROBE_NBITS 101   // Spectra in a probe: 13 + 16 + 64 + 8.
+#define PROBE_HIGH 3      // Sample for a one: the highest 2-bit sample.
+
+/* Struct to store a probe. */
+typedef struct {
+  unsigned int seq; // Sequence number, modulo 2^16.
+  uint64_t stamp;   // Time the block arrived, in us since the epoch.
+  long row;         // Spectrum it starts at, in its block.
+} Probe;
+
+/* Get the time now, in us since the epoch. */
+static inline uint64_t probe_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Get the CRC-8 (with polynomial 0x07) of a probe's contents. */
+static inline unsigned int probe_check(unsigned int seq, uint64_t stamp) {
+  unsigned char bytes[10] = {(unsigned char)(seq >> 8), (unsigned char)seq};
+  for (int k = 0; k < 8; ++k)
+    bytes[2 + k] = (unsigned char)(stamp >> (56 - 8 * k));
+  unsigned int crc = 0;
+  for (int k = 0; k < 10; ++k) {
+    crc ^= bytes[k];
+    for (int b = 0; b < 8; ++b)
+      crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) & 0xff : (crc << 1) & 0xff;
+  }
+  return crc;
+}
+
+/* Write some bits of a value, from the highest, a spectrum each. */
+static inline void probe_bits(unsigned char *p, int nf, int width,
+                              uint64_t value, int nbits) {
+  for (int k = nbits - 1; k >= 0; --k, p += nf)
+    for (int c = 0; c < width; ++c)
+      p[c] = ((value >> k) & 1) ? PROBE_HIGH : 0;
+}
+
+/* Write a probe into a block of spectra with nf channels each, starting
+ * at a spectrum, in the reserved channels [chan, chan + width).
+ */
+static inline void probe_write(unsigned char *blk, int nf, int chan, int width,
+                               const Probe *pr) {
+  unsigned char *p = blk + pr->row * nf + chan;
+  probe_bits(p, nf, width, PROBE_SYNC, PROBE_NSYNC);
+  p += (long)PROBE_NSYNC * nf;
+  probe_bits(p, nf, width, pr->seq & 0xffff, 16);
+  p += 16L * nf;
+  probe_bits(p, nf, width, pr->stamp, 64);
+  p += 64L * nf;
+  probe_bits(p, nf, width, probe_check(pr->seq & 0xffff, pr->stamp), 8);
+}
+
+/* Read the bit in a spectrum's reserved channels. Returns 1 or 0, or -1
+ * if they do not all agree, as they never do in noise for long.
+ */
+static inline int probe_bit(const unsigned char *p, int width) {
+  if ((p[0] != 0) && (p[0] != PROBE_HIGH)) return -1;
+  for (int c = 1; c < width; ++c)
+    if (p[c] != p[0]) return -1;
+  return p[0] == PROBE_HIGH;
+}
+
+/* Read some bits of a value, from the highest, a spectrum each. Returns
+ * false if any spectrum does not hold a bit.
+ */
+static inline bool probe_value(const unsigned char *p, int nf, int width,
+                               int nbits, uint64_t *value) {
+  *value = 0;
+  for (int k = 0; k < nbits; ++k, p += nf) {
+    int bit = probe_bit(p, width);
+    if (bit < 0) return false;
+    *value = (*value << 1) | (uint64_t)bit;
+  }
+  return true;
+}
+
+/* Find the first probe in a block of nt spectra with nf channels each,
+ * at or after a spectrum, in the reserved channels [chan, chan + width).
+ * Returns true if there is one, and false otherwise.
+ */
+static inline bool probe_find(const unsigned char *blk, int nf, long nt,
+                              int chan, int width, long from, Probe *pr) {
+  for (long row = from; row + PROBE_NBITS <= nt; ++row) {
+    const unsigned char *p = blk + row * nf + chan;
+    uint64_t sync, seq, stamp, check;
+    if (!probe_value(p, nf, width, PROBE_NSYNC, &sync) || (sync != PROBE_SYNC))
+      continue;
+    p += (long)PROBE_NSYNC * nf;
+    if (!probe_value(p, nf, width, 16, &seq)) continue;
+    p += 16L * nf;
+    if (!probe_value(p, nf, width, 64, &stamp)) continue;
+    p += 64L * nf;
+    if (!probe_value(p, nf, width, 8, &check) ||
+        (check != probe_check((unsigned int)seq, stamp)))
+      continue;
+    pr->seq = (unsigned int)seq;
+    pr->stamp = stamp;
+    pr->row = row;
+    return true;
+  }
+  return false;
+}
+
+/* Get the time since a probe's block arrived, in s. */
+static inline double probe_latency(const Probe *pr) {
+  return (double)(int64_t)(probe_now() - pr->stamp) * 1e-6;
+}
+
+#endif
@@ -0,0 +1,459 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  Requantization of 8-bit samples to 2 bits: a few kernels for doing it,
+  a pool of workers that splits a block into tiles and runs a kernel on
+  them (checksumming each as it goes, if asked to), and an autotuner that
+  finds the fastest kernel, tile size and number of workers for the
+  machine it runs on.
+ */
+
+#ifndef REQUANT_H
+#define REQUANT_H
+
+#include <immintrin.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "extern/log.h"
+#include "extern/toml.h"
+
+#include "arachne.h"
+#include "crc.h"
+
+/* KERNELS
+ * =======
+ *
+ * Requantizing keeps bits 5 and 4 of each sample. The samples in every
+ * 4-byte word are also reversed in order. All kernels give exactly the
+ * same result; they only differ in how many bytes they handle at once.
+ * Sizes must be multiples of 8. The vector kernels are compiled for
+ * their instruction sets whatever the build's flags are, and are only
+ * used on CPUs that support them.
+ */
+typedef void (*Kernel)(unsigned char *dst, const unsigned char *src,
+                       long size);
+
+/* One byte at a time. */
+static void requant_scalar(unsigned char *dst, const unsigned char *src,
+                           long size) {
+  for (long i = 0; i < size; i += 4) {
+    unsigned char a = src[i + 0];
+    unsigned char b = src[i + 1];
+    unsigned char c = src[i + 2];
+    unsigned char d = src[i + 3];
+    dst[i + 0] = (d >> 4) & 0x03;
+    dst[i + 1] = (c >> 4) & 0x03;
+    dst[i + 2] = (b >> 4) & 0x03;
+    dst[i + 3] = (a >> 4) & 0x03;
+  }
+}
+
+/* 8 bytes at a time, in a 64-bit register. */
+static void requant_swar(unsigned char *dst, const unsigned char *src,
+                         long size) {
+  for (long i = 0; i < size; i += 8) {
+    uint64_t x;
+    memcpy(&x, src + i, 8);
+    x = (x >> 4) & 0x0303030303030303ULL;
+    x = __builtin_bswap64(x);
+    x = (x >> 32) | (x << 32);
+    memcpy(dst + i, &x, 8);
+  }
+}
+
+/* 16 bytes at a time, with SSSE3's byte shuffles. */
+__attribute__((target("ssse3"))) static void
+requant_ssse3(unsigned char *dst, const unsigned char *src, long size) {
+  const __m128i mask = _mm_set1_epi8(0x03);
+  const __m128i order =
+      _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  long i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+    x = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(x, order));
+  }
+  requant_swar(dst + i, src + i, size - i);
+}
+
+/* 32 bytes at a time, with AVX2. */
+__attribute__((target("avx2"))) static void
+requant_avx2(unsigned char *dst, const unsigned char *src, long size) {
+  const __m256i mask = _mm256_set1_epi8(0x03);
+  const __m256i order = _mm256_setr_epi8(
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6,
+      5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  long i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+    x = _mm256_and_si256(_mm256_srli_epi16(x, 4), mask);
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(x, order));
+  }
+  requant_swar(dst + i, src + i, size - i);
+}
+
+enum { KERNEL_SCALAR, KERNEL_SWAR, KERNEL_SSSE3, KERNEL_AVX2, NKERNELS };
+
+static const char *kernel_names[NKERNELS] = {"scalar", "swar", "ssse3",
+                                             "avx2"};
+static const Kernel kernel_fns[NKERNELS] = {requant_scalar, requant_swar,
+                                            requant_ssse3, requant_avx2};
+
+/* Check whether this CPU can run a kernel. */
+static inline bool kernel_ok(int k) {
+  __builtin_cpu_init();
+  if (k == KERNEL_SSSE3) return __builtin_cpu_supports("ssse3");
+  if (k == KERNEL_AVX2) return __builtin_cpu_supports("avx2");
+  return (k >= 0) && (k < NKERNELS);
+}
+
+/* Get the kernel with a given name, or -1 if there is no such kernel. */
+static inline int kernel_find(const char *name) {
+  for (int k = 0; k < NKERNELS; ++k)
+    if (strcmp(name, kernel_names[k]) == 0) return k;
+  return -1;
+}
+
+/* POOL
+ * ====
+ *
+ * A block is split into tiles, which the workers (and the thread that
+ * hands out the work, which pitches in) take one at a time, until none
+ * are left. The workers wait on a condition variable between blocks.
+ *
+ * If the block's CRC is wanted, each tile is done a piece at a time, and
+ * each piece is checksummed right after the kernel writes it, while it is
+ * still in cache, so checksumming never reads the block back in. The CRCs
+ * of the tiles are combined once they are all done.
+ *
+ * The pool can also run a batch of tasks of any kind, numbered from 0,
+ * which the workers take in the same way, one at a time, so that a
+ * worker that is done with its task takes the next one, while another
+ * is still busy with a long one.
+ */
+#define POOL_PIECE (3 * CRC32C_LANE)
+
+/* A task of a batch: what it works on, and its number. */
+typedef void (*PoolTask)(void *ctx, long k);
+
+/* Struct to store how to requantize. */
+typedef struct {
+  int kernel;  // Kernel to use.
+  int threads; // Number of threads, including the caller.
+  long tile;   // Size of a tile, in bytes.
+} Tuning;
+
+/* Struct to store the pool of workers. */
+typedef struct {
+  int nworkers;             // Number of workers, besides the caller.
+  pthread_t *workers;       // The workers.
+  pthread_mutex_t lock;     // Guards everything below.
+  pthread_cond_t start;     // Signalled when there is a new block.
+  pthread_cond_t done;      // Signalled when a worker is done with a block.
+  unsigned long gen;        // Number of the current block.
+  int busy;                 // Number of workers still on the current block.
+  bool quit;                // Whether the workers should exit.
+  Kernel fn;                // Kernel for the current block.
+  PoolTask task;            // Task for the current batch, if any.
+  void *ctx;                // What the tasks work on.
+  unsigned char *dst;       // Where the current block goes.
+  const unsigned char *src; // Where the current block comes from.
+  long size;                // Size of the current block.
+  long tile;                // Size of a tile.
+  long next;                // Start of the next tile to take.
+  uint32_t *crcs;           // CRC of each tile, if the block's is wanted.
+  long ncrcs;               // Number of tiles there is room for in crcs.
+  bool checksum;            // Whether the block's CRC is wanted.
+} Pool;
+
+/* Requantize tiles of the current block, until there are none left. */
+static inline void pool_drain(Pool *p) {
+  if (p->task != NULL) {
+    for (;;) {
+      long k = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+      if (k >= p->size) break;
+      p->task(p->ctx, k);
+    }
+    return;
+  }
+  for (;;) {
+    long beg = __atomic_fetch_add(&p->next, p->tile, __ATOMIC_RELAXED);
+    if (beg >= p->size) break;
+    long len = (beg + p->tile > p->size) ? p->size - beg : p->tile;
+    if (!p->checksum) {
+      p->fn(p->dst + beg, p->src + beg, len);
+      continue;
+    }
+    uint32_t crc = 0;
+    for (long off = beg; off < beg + len; off += POOL_PIECE) {
+      long n = (off + POOL_PIECE > beg + len) ? beg + len - off : POOL_PIECE;
+      p->fn(p->dst + off, p->src + off, n);
+      crc = crc32c(crc, p->dst + off, n);
+    }
+    p->crcs[beg / p->tile] = crc;
+  }
+}
+
+/* Wait for blocks, and requantize them. */
+static void *pool_work(void *arg) {
+  Pool *p = (Pool *)arg;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&p->lock);
+  for (;;) {
+    while ((p->gen == seen) && !p->quit)
+      pthread_cond_wait(&p->start, &p->lock);
+    if (p->quit) break;
+    seen = p->gen;
+    pthread_mutex_unlock(&p->lock);
+    pool_drain(p);
+    pthread_mutex_lock(&p->lock);
+    if (--p->busy == 0) pthread_cond_signal(&p->done);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+/* Start a pool of workers. */
+static inline void pool_init(Pool *p, int threads) {
+  memset(p, 0, sizeof(Pool));
+  p->nworkers = (threads > 1) ? threads - 1 : 0;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start, NULL);
+  pthread_cond_init(&p->done, NULL);
+  p->workers = (pthread_t *)calloc(p->nworkers + 1, sizeof(pthread_t));
+  for (int i = 0; i < p->nworkers; ++i)
+    pthread_create(&p->workers[i], NULL, pool_work, p);
+}
+
+/* Stop a pool of workers. */
+static inline void pool_free(Pool *p) {
+  pthread_mutex_lock(&p->lock);
+  p->quit = true;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+  for (int i = 0; i < p->nworkers; ++i) pthread_join(p->workers[i], NULL);
+  free(p->workers);
+  free(p->crcs);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->start);
+  pthread_cond_destroy(&p->done);
+}
+
+/* Start the workers on what has been set up, with the lock held, pitch
+ * in, and wait for them to be done.
+ */
+static inline void pool_go(Pool *p) {
+  p->next = 0;
+  p->busy = p->nworkers;
+  p->gen++;
+  if (p->nworkers > 0) pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+
+  pool_drain(p);
+
+  pthread_mutex_lock(&p->lock);
+  while (p->busy > 0) pthread_cond_wait(&p->done, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* Run a batch of tasks with the pool, and wait for them to be done. */
+static inline void pool_each(Pool *p, PoolTask task, void *ctx, long ntasks) {
+  pthread_mutex_lock(&p->lock);
+  p->task = task;
+  p->ctx = ctx;
+  p->size = ntasks;
+  pool_go(p);
+}
+
+/* Requantize a block with the pool, and wait for it to be done. If crc
+ * is not NULL, the block's CRC is stored there.
+ */
+static inline void pool_run(Pool *p, Kernel fn, unsigned char *dst,
+                            const unsigned char *src, long size, long tile,
+                            uint32_t *crc) {
+  long ntiles = (size + tile - 1) / tile;
+  if ((crc != NULL) && (ntiles > p->ncrcs)) {
+    p->crcs = (uint32_t *)realloc(p->crcs, ntiles * sizeof(uint32_t));
+    p->ncrcs = ntiles;
+  }
+  pthread_mutex_lock(&p->lock);
+  p->fn = fn;
+  p->task = NULL;
+  p->dst = dst;
+  p->src = src;
+  p->size = size;
+  p->tile = tile;
+  p->checksum = (crc != NULL);
+  pool_go(p);
+
+  if (crc == NULL) return;
+  uint32_t whole = p->crcs[0];
+  uint32_t shift = crc32c_shift(tile);
+  for (long i = 1; i < ntiles; ++i) {
+    long len = (i * tile + tile > size) ? size - i * tile : tile;
+    if (len == tile)
+      whole = crc32c_mult(shift, whole) ^ p->crcs[i];
+    else
+      whole = crc32c_combine(whole, p->crcs[i], len);
+  }
+  *crc = whole;
+}
+
+/* AUTOTUNING
+ * ==========
+ *
+ * The autotuner requantizes a synthetic block of random samples, of the
+ * real size, with every combination of kernel, number of threads and
+ * tile size, and keeps the fastest. Blocks are checksummed as they are
+ * requantized, as arachne does. Each combination is timed a few times,
+ * and its best time counts, to be robust against interruptions.
+ * Kernels whose output differs from the scalar kernel's are skipped.
+ */
+#define TUNE_REPEATS 3
+
+/* Get the time from a monotonic clock, in s. */
+static inline double tune_clock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Time a combination on a block, in s. */
+static inline double tune_time(Tuning t, unsigned char *dst,
+                               const unsigned char *src, long size) {
+  Pool p;
+  pool_init(&p, t.threads);
+  double best = INFINITY;
+  for (int r = 0; r < TUNE_REPEATS; ++r) {
+    double t0 = tune_clock();
+    uint32_t crc;
+    pool_run(&p, kernel_fns[t.kernel], dst, src, size, t.tile, &crc);
+    best = fmin(best, tune_clock() - t0);
+  }
+  pool_free(&p);
+  return best;
+}
+
+/* Find the fastest way to requantize blocks of a given size on this
+ * machine, with up to maxthreads threads.
+ */
+static inline Tuning autotune(long size, int maxthreads) {
+  unsigned char *src = (unsigned char *)malloc(size);
+  unsigned char *dst = (unsigned char *)malloc(size);
+  unsigned char *ref = (unsigned char *)malloc(size);
+  uint64_t x = 0x9e3779b97f4a7c15ULL;
+  for (long i = 0; i < size; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    src[i] = (unsigned char)x;
+  }
+  memset(dst, 0, size);
+  requant_scalar(ref, src, size);
+
+  static const long tiles[] = {64L << 10, 256L << 10, 1L << 20, 4L << 20,
+                               16L << 20};
+  int ntiles = sizeof(tiles) / sizeof(tiles[0]);
+
+  Tuning best = {KERNEL_SWAR, 1, size};
+  double tbest = INFINITY;
+  for (int k = 0; k < NKERNELS; ++k) {
+    if (!kernel_ok(k)) continue;
+    kernel_fns[k](dst, src, size);
+    if (memcmp(dst, ref, size) != 0) {
+      log_warn("Kernel %s gives the wrong result, skipping.", kernel_names[k]);
+      continue;
+    }
+    for (int nt = 1; nt <= maxthreads;
+         nt = ((nt < maxthreads) && (2 * nt > maxthreads)) ? maxthreads
+                                                            : 2 * nt) {
+      for (int i = 0; i <= ntiles; ++i) {
+        /* The last tile size splits the block evenly between threads. */
+        long tile = (i < ntiles) ? tiles[i] : size / nt;
+        if ((tile > size) || (tile % 32 != 0)) continue;
+        if ((nt == 1) && (i < ntiles)) continue;
+        Tuning t = {k, nt, tile};
+        double secs = tune_time(t, dst, src, size);
+        log_info("Kernel %-6s, %2d threads, %8ld B tiles: %.2f GB/s.",
+                 kernel_names[k], nt, tile, size / secs / 1e9);
+        if (secs < tbest) {
+          tbest = secs;
+          best = t;
+        }
+      }
+    }
+  }
+  free(src);
+  free(dst);
+  free(ref);
+  return best;
+}
+
+/* PROFILES
+ * ========
+ *
+ * The result of autotuning is saved to a profile, named after the host,
+ * so that a directory of profiles can be shared between machines, and
+ * each loads its own.
+ */
+
+/* Get the path of this machine's profile, in a directory. */
+static inline void profile_path(char *path, size_t len, const char *dir) {
+  char host[256] = "localhost";
+  gethostname(host, sizeof(host) - 1);
+  snprintf(path, len, "%s/arachne-%s.tune", dir, host);
+}
+
+/* Save a profile. Returns 0 on success, and -1 otherwise. */
+static inline int profile_save(const char *path, Tuning t) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) return -1;
+  fprintf(fp, "# Written by arachne --autotune.\n");
+  fprintf(fp, "[tune]\n");
+  fprintf(fp, "kernel = \"%s\"\n", kernel_names[t.kernel]);
+  fprintf(fp, "threads = %d\n", t.threads);
+  fprintf(fp, "tile = %ld\n", t.tile);
+  fclose(fp);
+  return 0;
+}
+
+/* Load a profile. Returns 0 on success, and -1 if there is no profile,
+ * or it is not usable on this machine.
+ */
+static inline int profile_load(const char *path, Tuning *t) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) return -1;
+  char errbuf[200];
+  toml_table_t *fields = toml_parse_file(fp, errbuf, sizeof(errbuf));
+  fclose(fp);
+  if (fields == NULL) return -1;
+
+  toml_table_t *tab = section(fields, "tune");
+  toml_datum_t kernel = toml_string_in(tab, "kernel");
+  toml_datum_t threads = toml_int_in(tab, "threads");
+  toml_datum_t tile = toml_int_in(tab, "tile");
+  int k = (kernel.ok) ? kernel_find(kernel.u.s) : -1;
+  if (kernel.ok) free(kernel.u.s);
+  toml_free(fields);
+  if (!(threads.ok && tile.ok) || !kernel_ok(k) || (threads.u.i < 1) ||
+      (tile.u.i < 32) || (tile.u.i % 32 != 0))
+    return -1;
+  t->kernel = k;
+  t->threads = threads.u.i;
+  t->tile = tile.u.i;
+  return 0;
+}
+
+#endif
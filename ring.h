@@ -0,0 +1,469 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  The layout of the ring buffers, and helpers for consumers of the ring
+  buffer that arachne writes to. It needs _GNU_SOURCE to be defined, for
+  memfds.
+
+  This header, and the others that consumers of arachne's output need
+  (crc.h for checksums of blocks, export.h for streaming them over TCP,
+  dumpidx.h for dumps of them, and probe.h for latency probes in them),
+  only depend on the C library and on each other, so consumers can
+  simply copy them into their own code.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc.h" // For checksums of blocks.
+
+/* SHARED MEMORY SHENANIGANS!
+ * ==========================
+ *
+ * For a sampling time of 1.31072 ms, the shared memory at the
+ * telescope is structured as 32 blocks, with each block being
+ * 512 samples, or 0.67108864 s, long. The entire shared memory
+ * at the telescope is 21.47483648 s long, with a size of 64 MB.
+ * We then form another shared memory when we wish to search for
+ * FRBs, where each block is 21.47483648 s long, and there are
+ * 16 blocks. This makes this shared memory 343.59738368 s long,
+ * with a size of 1 GB.
+ */
+#define MAXBLKS 16
+#define IN_HDRKEY 2031
+#define IN_BUFKEY 2032
+#define OUT_HDRKEY 5031
+#define OUT_BUFKEY 5032
+#define BLKSIZE (32 * 512 * 4096)
+#define TOTALSIZE (long)(BLKSIZE) * (long)(MAXBLKS)
+
+/* Struct for storing data from the ring buffer. */
+typedef struct {
+  unsigned int flag;
+  unsigned int curr_blk;
+  unsigned int curr_rec;
+  unsigned int blk_size;
+  int overflow;
+  double comptime[MAXBLKS];
+  double datatime[MAXBLKS];
+  unsigned char data[TOTALSIZE];
+} Buffer;
+
+/* Struct for storing the ring buffer's header. */
+typedef struct {
+  unsigned int active;
+  unsigned int status;
+  double comptime;
+  double datatime;
+  double reftime;
+  struct timeval timestamp[MAXBLKS];
+  struct timeval timestamp_gps[MAXBLKS];
+  double blk_nano[MAXBLKS];
+} Header;
+
+/* Struct for storing the header of the ring buffer arachne writes to.
+ * It starts with the same header as the telescope's ring buffer, so
+ * consumers that only know about that can attach to it unchanged.
+ *
+ * It is followed by a sequence number for each slot, in the manner of
+ * a seqlock. Arachne makes a slot's sequence number odd before writing
+ * to the slot, and even again after, before it publishes the block by
+ * bumping curr_blk. All of these are stored with release semantics, so
+ * a consumer that loads them with acquire semantics never sees a block
+ * before its data, and can tell if a slot was rewritten as it read it.
+ * Each block's CRC32C is published along with it, so that consumers can
+ * tell if it was corrupted on the way to them, and so is the time it was
+ * published at, so that they can tell how long it took them to read it.
+ */
+#define RING_MAGIC 0x41524e32 // "ARN2".
+
+typedef struct {
+  Header hdr;
+  unsigned int magic;          // Always RING_MAGIC.
+  unsigned int seq[MAXBLKS];   // Sequence number of each slot.
+  unsigned int blkno[MAXBLKS]; // Number of the block held in each slot.
+  unsigned int flags[MAXBLKS]; // Flags for the block held in each slot.
+  unsigned int crc[MAXBLKS];   // CRC32C of the block held in each slot.
+  double pubtime[MAXBLKS];     // When each block was published, in s since
+                               // the epoch.
+} RingHeader;
+
+/* Flags for a block in the ring buffer. */
+#define RING_REALIGN 1 // Blocks before this one were skipped.
+#define RING_DISCONT 2 // The producer restarted just before this block.
+
+/* Results of reading a block from the ring buffer. */
+enum { RING_OK, RING_PENDING, RING_OVERRUN, RING_CORRUPT };
+
+/* Start writing a block to a slot. */
+static inline void ring_write_begin(RingHeader *hdr, int slot) {
+  unsigned int seq = __atomic_load_n(&hdr->seq[slot], __ATOMIC_RELAXED);
+  __atomic_store_n(&hdr->seq[slot], seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Finish writing a block to a slot, and publish it, with its CRC, and
+ * the time now.
+ */
+static inline void ring_write_end(RingHeader *hdr, Buffer *buf, int slot,
+                                  unsigned int blk, unsigned int flags,
+                                  unsigned int crc) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  unsigned int seq = __atomic_load_n(&hdr->seq[slot], __ATOMIC_RELAXED);
+  hdr->pubtime[slot] = now.tv_sec + now.tv_nsec * 1e-9;
+  __atomic_store_n(&hdr->blkno[slot], blk, __ATOMIC_RELAXED);
+  __atomic_store_n(&hdr->flags[slot], flags, __ATOMIC_RELAXED);
+  __atomic_store_n(&hdr->crc[slot], crc, __ATOMIC_RELAXED);
+  __atomic_store_n(&hdr->seq[slot], seq + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&buf->curr_rec, (slot + 1) % MAXBLKS, __ATOMIC_RELEASE);
+  __atomic_store_n(&buf->curr_blk, blk + 1, __ATOMIC_RELEASE);
+}
+
+/* Give up writing to a slot, and leave it empty, so that consumers do
+ * not mistake whatever is left in it for a block.
+ */
+static inline void ring_write_abort(RingHeader *hdr, int slot) {
+  unsigned int seq = __atomic_load_n(&hdr->seq[slot], __ATOMIC_RELAXED);
+  __atomic_store_n(&hdr->blkno[slot], ~0u, __ATOMIC_RELAXED);
+  __atomic_store_n(&hdr->seq[slot], seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Read a block from the ring buffer into dst, consistently, and check
+ * its CRC as it is copied, along with the time it was published, if
+ * asked for. Returns RING_PENDING if the block has not been published
+ * yet, RING_OVERRUN if its slot has been (or was being) rewritten by a
+ * later block, RING_CORRUPT if it does not match its CRC, and RING_OK
+ * otherwise.
+ */
+static inline int ring_read(RingHeader *hdr, Buffer *buf, unsigned int blk,
+                            unsigned char *dst, double *pubtime) {
+  unsigned int published = __atomic_load_n(&buf->curr_blk, __ATOMIC_ACQUIRE);
+  if ((int)(blk - published) >= 0) return RING_PENDING;
+  if (published - blk > MAXBLKS) return RING_OVERRUN;
+
+  int slot = blk % MAXBLKS;
+  unsigned int seq = __atomic_load_n(&hdr->seq[slot], __ATOMIC_ACQUIRE);
+  unsigned int held = __atomic_load_n(&hdr->blkno[slot], __ATOMIC_RELAXED);
+  unsigned int crc = __atomic_load_n(&hdr->crc[slot], __ATOMIC_RELAXED);
+  if ((seq & 1) || (held != blk)) return RING_OVERRUN;
+  if (pubtime != NULL) *pubtime = hdr->pubtime[slot];
+  unsigned int got =
+      crc32c_copy(dst, buf->data + (long)BLKSIZE * (long)slot, BLKSIZE);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&hdr->seq[slot], __ATOMIC_RELAXED) != seq)
+    return RING_OVERRUN;
+  return (got == crc) ? RING_OK : RING_CORRUPT;
+}
+
+/* TRANSPORTS
+ * ==========
+ *
+ * A ring buffer lives in two shared memory segments, one for its header
+ * and one for its data. These may be SysV segments (which the telescope
+ * uses), POSIX segments, or memfds. SysV segments are found by their
+ * keys. POSIX segments are named after their keys, with a prefix, as in
+ * "/arachne.5031", so that instances with different prefixes never
+ * collide. A memfd has no name at all: its creator serves the file
+ * descriptors of both segments over a Unix socket, and anyone who wants
+ * to attach connects to the socket to receive them.
+ */
+enum { RING_SYSV, RING_POSIX, RING_MEMFD };
+
+#define SEG_CREATE 1 // Create the segment, if it does not exist.
+#define SEG_RDONLY 2 // Map the segment read-only.
+#define SEG_HUGE 4   // Back the segment with huge pages.
+#define SEG_HUGESIZE (2L * 1024 * 1024)
+
+/* Struct to store a shared memory segment. */
+typedef struct {
+  int backend; // RING_SYSV, RING_POSIX or RING_MEMFD.
+  int id;      // SysV id, or file descriptor otherwise.
+  void *addr;  // Address the segment is mapped at.
+  size_t size; // Size of the segment.
+} Segment;
+
+/* Get the backend with a given name, or -1 if there is no such backend. */
+static inline int ring_backend(const char *name) {
+  if (strcmp(name, "sysv") == 0) return RING_SYSV;
+  if (strcmp(name, "posix") == 0) return RING_POSIX;
+  if (strcmp(name, "memfd") == 0) return RING_MEMFD;
+  return -1;
+}
+
+/* Map a segment from its file descriptor. Returns 0 on success, and -1
+ * otherwise.
+ */
+static inline int seg_map(Segment *seg, int fd, size_t size, int flags) {
+  int prot = PROT_READ | ((flags & SEG_RDONLY) ? 0 : PROT_WRITE);
+  if (flags & SEG_HUGE) size = (size + SEG_HUGESIZE - 1) & ~(SEG_HUGESIZE - 1);
+  seg->id = fd;
+  seg->size = size;
+  seg->addr = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (seg->addr == MAP_FAILED) {
+    seg->addr = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/* Open (and possibly create) a segment, and map it. For memfds, this
+ * always creates a new segment. Returns 0 on success, and -1 otherwise.
+ */
+static inline int seg_open(Segment *seg, int backend, const char *prefix,
+                           int key, size_t size, int flags, int mode) {
+  memset(seg, 0, sizeof(Segment));
+  seg->backend = backend;
+  seg->id = -1;
+  bool create = (flags & SEG_CREATE);
+  bool huge = (flags & SEG_HUGE);
+  if (huge) size = (size + SEG_HUGESIZE - 1) & ~(SEG_HUGESIZE - 1);
+
+  if (backend == RING_SYSV) {
+    int shmflg = create ? (IPC_CREAT | mode | (huge ? SHM_HUGETLB : 0)) : 0;
+    seg->id = shmget(key, size, shmflg);
+    if ((seg->id < 0) && create && (errno == EINVAL)) {
+      /* A stale segment of the wrong size is in the way. */
+      shmctl(shmget(key, 0, 0), IPC_RMID, NULL);
+      seg->id = shmget(key, size, shmflg);
+    }
+    if (seg->id < 0) return -1;
+    seg->size = size;
+    seg->addr = shmat(seg->id, NULL, (flags & SEG_RDONLY) ? SHM_RDONLY : 0);
+    if (seg->addr == (void *)-1) {
+      seg->addr = NULL;
+      return -1;
+    }
+    return 0;
+  }
+
+  int fd = -1;
+  if (backend == RING_POSIX) {
+    char name[256];
+    snprintf(name, sizeof(name), "/%s.%d", prefix, key);
+    int oflag = create                  ? (O_CREAT | O_RDWR)
+                : (flags & SEG_RDONLY) ? O_RDONLY
+                                        : O_RDWR;
+    fd = shm_open(name, oflag, mode);
+  } else if ((backend == RING_MEMFD) && create) {
+    char name[256];
+    snprintf(name, sizeof(name), "%s.%d", prefix, key);
+    fd = memfd_create(name, MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0));
+  }
+  if (fd < 0) return -1;
+
+  struct stat st;
+  if (create && (fstat(fd, &st) == 0) && ((size_t)st.st_size != size)) {
+    if (ftruncate(fd, size) < 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  seg->backend = backend;
+  if (seg_map(seg, fd, size, flags) < 0) {
+    close(fd);
+    return -1;
+  }
+  return 0;
+}
+
+/* Unmap a segment, and forget about it. Segments are not removed, so
+ * that consumers that are still attached are not cut off.
+ */
+static inline void seg_close(Segment *seg) {
+  if (seg->addr != NULL) {
+    if (seg->backend == RING_SYSV)
+      shmdt(seg->addr);
+    else
+      munmap(seg->addr, seg->size);
+  }
+  if ((seg->backend != RING_SYSV) && (seg->id >= 0)) close(seg->id);
+  seg->addr = NULL;
+  seg->id = -1;
+}
+
+/* Fault in every page of a segment, so that the first block written to
+ * each slot does not pay for it. Its contents are left as they are.
+ */
+static inline void seg_prefault(Segment *seg) {
+#ifdef MADV_POPULATE_WRITE
+  if (madvise(seg->addr, seg->size, MADV_POPULATE_WRITE) == 0) return;
+#endif
+  long page = sysconf(_SC_PAGESIZE);
+  volatile unsigned char *p = (volatile unsigned char *)seg->addr;
+  for (size_t off = 0; off < seg->size; off += page) p[off] = p[off];
+}
+
+/* Check whether two segments are the same segment. */
+static inline bool seg_same(Segment *a, Segment *b) {
+  if (a->backend == RING_SYSV) return (a->id == b->id);
+  struct stat sa, sb;
+  if ((fstat(a->id, &sa) < 0) || (fstat(b->id, &sb) < 0)) return false;
+  return (sa.st_dev == sb.st_dev) && (sa.st_ino == sb.st_ino);
+}
+
+/* Find the segment that a key currently refers to, without mapping it,
+ * to tell if a segment has been replaced. Returns 0 if it exists, and
+ * -1 otherwise. Memfds cannot be found this way, since they have no name.
+ */
+static inline int seg_find(Segment *seg, int backend, const char *prefix,
+                           int key) {
+  memset(seg, 0, sizeof(Segment));
+  seg->backend = backend;
+  seg->id = -1;
+  if (backend == RING_SYSV) {
+    seg->id = shmget(key, 0, 0);
+  } else if (backend == RING_POSIX) {
+    char name[256];
+    snprintf(name, sizeof(name), "/%s.%d", prefix, key);
+    seg->id = shm_open(name, O_RDONLY, 0);
+  }
+  return (seg->id < 0) ? -1 : 0;
+}
+
+/* Remove the segment that a key refers to. It goes away once everyone
+ * attached to it has detached, and the key is free to be used by a new
+ * segment right away. Memfds go away on their own.
+ */
+static inline void seg_remove(int backend, const char *prefix, int key) {
+  if (backend == RING_SYSV) {
+    int id = shmget(key, 0, 0);
+    if (id >= 0) shmctl(id, IPC_RMID, NULL);
+  } else if (backend == RING_POSIX) {
+    char name[256];
+    snprintf(name, sizeof(name), "/%s.%d", prefix, key);
+    shm_unlink(name);
+  }
+}
+
+/* Listen for consumers of memfd segments on a Unix socket. Returns the
+ * listening socket, or -1 on failure.
+ */
+static inline int ring_listen(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) return -1;
+  unlink(path);
+  if ((bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+      (listen(sock, 16) < 0)) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/* Send the file descriptors of a ring buffer's segments (the header's,
+ * and then the data's) to a connected consumer.
+ */
+static inline int ring_send(int conn, Segment *hdr, Segment *buf) {
+  int fds[2] = {hdr->id, buf->id};
+  size_t sizes[2] = {hdr->size, buf->size};
+  char ctrl[CMSG_SPACE(sizeof(fds))];
+  memset(ctrl, 0, sizeof(ctrl));
+
+  struct iovec iov = {sizes, sizeof(sizes)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  return (sendmsg(conn, &msg, MSG_NOSIGNAL) < 0) ? -1 : 0;
+}
+
+/* Attach to a ring buffer in memfd segments, served on a Unix socket.
+ * Returns 0 on success, and -1 otherwise.
+ */
+static inline int ring_connect(const char *path, Segment *hdr, Segment *buf,
+                               int flags) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) return -1;
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+
+  int fds[2];
+  size_t sizes[2];
+  char ctrl[CMSG_SPACE(sizeof(fds))];
+  struct iovec iov = {sizes, sizeof(sizes)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctrl;
+  msg.msg_controllen = sizeof(ctrl);
+  ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  close(sock);
+  if (n < 0) return -1;
+
+  /* Whatever descriptors arrived are ours to close, if anything is off. */
+  int nfds = 0;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if ((cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) &&
+      (cmsg->cmsg_type == SCM_RIGHTS)) {
+    nfds = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    if (nfds > 2) nfds = 2;
+    memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+  }
+  if ((n != sizeof(sizes)) || (nfds != 2)) {
+    for (int k = 0; k < nfds; ++k) close(fds[k]);
+    return -1;
+  }
+
+  /* Each descriptor is closed once: by seg_close, once its segment is
+   * mapped, and by hand, until then.
+   */
+  memset(hdr, 0, sizeof(Segment));
+  memset(buf, 0, sizeof(Segment));
+  hdr->backend = buf->backend = RING_MEMFD;
+  hdr->id = buf->id = -1;
+  if (seg_map(hdr, fds[0], sizes[0], flags & SEG_RDONLY) < 0) {
+    hdr->id = -1;
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (seg_map(buf, fds[1], sizes[1], flags & SEG_RDONLY) < 0) {
+    buf->id = -1;
+    seg_close(hdr);
+    close(fds[1]);
+    return -1;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  A small, reentrant random number generator (xoshiro256**), for use
+  from several threads at once. Each thread keeps its own state, which
+  is seeded from a single 64-bit number via splitmix64.
+ */
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* Struct to store the state of the RNG. */
+typedef struct {
+  uint64_t s[4];
+} Rng;
+
+/* Mix a 64-bit number (splitmix64). Also useful to derive seeds. */
+static inline uint64_t rng_mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+/* Seed the RNG. */
+static inline void rng_seed(Rng *r, uint64_t seed) {
+  for (int i = 0; i < 4; ++i) {
+    seed = rng_mix(seed);
+    r->s[i] = seed;
+  }
+}
+
+/* Get the next 64-bit number from the RNG. */
+static inline uint64_t rng_next(Rng *r) {
+  uint64_t *s = r->s;
+  uint64_t x = s[1] * 5;
+  uint64_t out = ((x << 7) | (x >> 57)) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = (s[3] << 45) | (s[3] >> 19);
+  return out;
+}
+
+/* Get a random number from the RNG in [0, 1). */
+static inline double rng_uniform(Rng *r) {
+  return (rng_next(r) >> 11) * 0x1.0p-53;
+}
+
+#endif
@@ -0,0 +1,117 @@
+/*
+  ▄▀▄ █▀▄ ▄▀▄ ▄▀▀ █▄█ █▄ █ ██▀
+  █▀█ █▀▄ █▀█ ▀▄▄ █ █ █ ▀█ █▄▄
+
+  Weave in fake FRBs into live GMRT data.
+  Code: https://github.com/astrogewgaw/arachne.
+
+  Tracing of allocations in the main loop, for builds with ARACHNE_TRACE
+  defined (as "make trace" does). Once the main loop has warmed up, it
+  should not allocate at all: everything it needs for a block comes from
+  the block's arena, or was set up before. To check that it does not,
+  malloc and friends are replaced with wrappers that, once tracing is
+  armed on a thread, count every call made on that thread and print a
+  backtrace of it to stderr. Other threads (the exporter's, the
+  checkpoint's writer, and the pool's, which only run kernels) are not
+  traced. Frees are not either: letting go of a burst that was set up
+  at startup is fine, and memory that churns shows up as allocations.
+  Without ARACHNE_TRACE, arming and disarming do nothing, and allocations
+  are left alone.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef ARACHNE_TRACE
+
+#include <errno.h>
+#include <execinfo.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TRACE_DEPTH 32 // Most frames in a backtrace.
+
+/* The allocator's own entry points, which the wrappers call through to. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+static __thread bool trace_armed;     // Whether this thread is traced.
+static __thread bool trace_reporting; // Whether a report is being made.
+static unsigned long trace_count;     // Allocations made while armed.
+
+/* Report a call to the allocator, if this thread is traced. */
+static void trace_report(const char *what, size_t size) {
+  if (!trace_armed || trace_reporting) return;
+  trace_reporting = true;
+  __atomic_add_fetch(&trace_count, 1, __ATOMIC_RELAXED);
+  char msg[128];
+  int n = snprintf(msg, sizeof(msg),
+                   "Allocation in the main loop: %s(%zu), from:\n", what,
+                   size);
+  ssize_t res = write(STDERR_FILENO, msg, n);
+  (void)res;
+  void *frames[TRACE_DEPTH];
+  int nframes = backtrace(frames, TRACE_DEPTH);
+  backtrace_symbols_fd(frames, nframes, STDERR_FILENO);
+  trace_reporting = false;
+}
+
+void *malloc(size_t size) {
+  trace_report("malloc", size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  trace_report("calloc", n * size);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  trace_report("realloc", size);
+  return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t align, size_t size) {
+  trace_report("aligned_alloc", size);
+  return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size) {
+  trace_report("posix_memalign", size);
+  *ptr = __libc_memalign(align, size);
+  return (*ptr == NULL) ? ENOMEM : 0;
+}
+
+/* Start tracing this thread, if it is not already. The first backtrace
+ * loads the unwinder, which allocates, so it is taken here, before
+ * tracing starts.
+ */
+static inline void trace_arm() {
+  if (trace_armed) return;
+  void *frames[1];
+  backtrace(frames, 1);
+  trace_armed = true;
+}
+
+/* Stop tracing this thread. */
+static inline void trace_disarm() { trace_armed = false; }
+
+/* Get the number of allocations made while armed. */
+static inline unsigned long trace_allocs() {
+  return __atomic_load_n(&trace_count, __ATOMIC_RELAXED);
+}
+
+#else
+
+static inline void trace_arm() {}
+static inline void trace_disarm() {}
+
+#endif
+
+#endif